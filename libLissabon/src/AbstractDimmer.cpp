@@ -2,9 +2,12 @@
 
 namespace Lissabon {
 
+uint32_t AbstractDimmer::identityChanges = 0;
+
 bool AbstractDimmer::setName(String value) {
   if (name == value) return false;
   name = value;
+  identityChanges++;
   return true;
 }
 
@@ -18,6 +21,12 @@ bool AbstractDimmer::hasName() {
 }
 
 void AbstractDimmer::updateDimmer() {
+  if (generationCounted) {
+    generationCounted = false;
+  } else {
+    stateGeneration++;
+  }
+  commandCompletedMillis = millis();
 #ifdef DIMMER_WITH_ANIMATION
   float newLevel = isOn ? level : 0;
   if (animationEndMillis > 0) {
@@ -80,7 +89,45 @@ float AbstractDimmer::applyGamma(float level) {
 }
 #endif
 
-void AbstractDimmer::identify() {}
+void AbstractDimmer::identify() {
+  // Two rapid flashes
+  startEffect(2, 100, 100);
+}
+
+void AbstractDimmer::startEffect(int flashes, uint32_t onMillis, uint32_t offMillis, float onLevel) {
+  if (flashes <= 0 || onMillis + offMillis == 0) return;
+  effectFlashes = flashes;
+  effectOnMillis = onMillis;
+  effectOffMillis = offMillis;
+  effectOnLevel = onLevel;
+  effectShownLevel = -1;
+  effectStartMillis = millis();
+  if (effectStartMillis == 0) effectStartMillis = 1;
+  iotsaConfig.postponeSleep(flashes*(onMillis+offMillis)+100);
+}
+
+AbstractDimmer::EffectState AbstractDimmer::effectStep(float& effectLevel) {
+  if (effectStartMillis == 0) return effect_idle;
+  uint32_t elapsed = millis() - effectStartMillis;
+  uint32_t period = effectOnMillis + effectOffMillis;
+  if (elapsed >= period*effectFlashes) {
+    effectStartMillis = 0;
+    effectFinished();
+    return effect_idle;
+  }
+  effectLevel = (elapsed % period) < effectOnMillis ? effectOnLevel : 0;
+  if (effectLevel == effectShownLevel) return effect_unchanged;
+  effectShownLevel = effectLevel;
+  return effect_changed;
+}
+
+void AbstractDimmer::effectFinished() {
+#ifdef DIMMER_WITH_ANIMATION
+  // Have loop() output the current level again. A fade that was in progress
+  // has continued underneath the effect, and simply carries on.
+  if (animationEndMillis == 0) animationStartMillis = animationEndMillis = millis();
+#endif
+}
 
 String AbstractDimmer::info() {
   String message = "Dimmer";
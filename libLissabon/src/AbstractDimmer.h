@@ -5,6 +5,7 @@
 #include "iotsaApi.h"
 #include "iotsaConfigFile.h"
 #include <ArduinoJson.h>
+#include <atomic>
 using namespace ArduinoJson;
 
 #ifndef DIMMER_WITHOUT_LEVEL
@@ -28,14 +29,26 @@ class AbstractDimmer : IotsaApiModObject {
 public:
   AbstractDimmer(int _num, DimmerCallbacks* _callbacks)
   : num(_num),
-    callbacks(_callbacks)
+    callbacks(_callbacks),
+    stateGeneration(esp_random())
   {}
   virtual ~AbstractDimmer() {}
   virtual void updateDimmer();
+  // Like updateDimmer(), but for intermediate values of a continuous change
+  // (dragging a slider, turning an encoder) where only the latest value matters.
+  virtual void updateDimmerStreaming() { updateDimmer(); }
+  // Like updateDimmer(), but only the given fields were changed. A remote
+  // dimmer sends only those, so values we never read from it (after a group
+  // "all off", for example) aren't overwritten with our defaults.
+  enum Field { field_isOn = 1, field_level = 2, field_temperature = 4, field_all = 7 };
+  virtual void updateDimmerFields(int fields) { updateDimmer(); }
   void calcCurLevel();
   virtual bool available() = 0;
   virtual bool dataValid() { return true; }
   virtual void refresh() {}
+  // The user has started doing something (touched a pad, woke us) that will
+  // probably be followed by a command: get ready for it, if that takes time.
+  virtual void preconnect() {}
   String info();
   virtual void getHandler(JsonObject& reply) override;
   virtual bool putHandler(const JsonVariant& request) override;
@@ -48,13 +61,48 @@ public:
   virtual bool setName(String value);
   String getUserVisibleName();
   bool hasName();
+  // Address of the device this object controls, if it is a remote one.
+  virtual String getAddress() { return ""; }
+  // Relative cost of sending a command right now (0: immediate), used to
+  // order batches so the quick ones aren't held up by the slow ones.
+  virtual int commandCost() { return 0; }
+  // Incremented whenever the name or address of any dimmer changes, so
+  // collections know when to rebuild their indexes.
+  static uint32_t identityChanges;
   virtual void identify();
   virtual void setup() {};
   virtual void loop() {};
+  // Transient effects (identify flashes, error blinks) are shown on top of
+  // the current state and never block. startEffect() replaces any running
+  // effect, the subclass loop() calls effectStep() first and shows
+  // effectLevel (0..1) in stead of curLevel unless it returns effect_idle.
+  enum EffectState { effect_idle, effect_unchanged, effect_changed };
+  void startEffect(int flashes, uint32_t onMillis, uint32_t offMillis, float onLevel=1);
+  EffectState effectStep(float& effectLevel);
+  bool effectActive() { return effectStartMillis != 0; }
+protected:
+  // Called once when an effect has finished, to get the current state shown again.
+  virtual void effectFinished();
+  uint32_t effectStartMillis = 0;
+  int effectFlashes = 0;
+  uint32_t effectOnMillis = 0;
+  uint32_t effectOffMillis = 0;
+  float effectOnLevel = 0;
+  float effectShownLevel = -1;
 public:
   int num;
   DimmerCallbacks *callbacks;
   bool isOn = 0;        // if true we want to show level, if false we want to be off.
+  // Incremented by updateDimmer(). Starts at a random value so a client
+  // won't mistake a rebooted dimmer for one that hasn't changed. Atomic
+  // because DimmerBLEServer counts BLE writes in the BLE host task.
+  std::atomic<uint32_t> stateGeneration;
+  // Set just before an updateDimmer() whose changes were already counted
+  // in stateGeneration, so it doesn't count them again.
+  bool generationCounted = false;
+  // When the last updateDimmer() took effect (for a remote dimmer: when the
+  // device acknowledged it), 0 while it hasn't yet.
+  uint32_t commandCompletedMillis = 0;
 #ifdef DIMMER_WITH_LEVEL
   float level = 0;      // Requested light level
   float curLevel = 0;   // actual current light level (depends level, isOn, gamma, animation progress)
@@ -12,20 +12,18 @@ namespace Lissabon {
 
 BLEDimmer::BLEDimmer(int _num, IotsaBLEClientMod &_bleClientMod, DimmerCallbacks *_callbacks, int _stayConnectedMillis)
 : AbstractDimmer(_num, _callbacks), 
+  keepOpenModel(_stayConnectedMillis),
   bleClientMod(_bleClientMod),
   stayConnectedMillis(_stayConnectedMillis)
 {
 #ifdef IOTSA_WITH_BLE_TASKS
-  xTaskCreate(BLEDimmer::_connectionTask, name.c_str(), 5000, this, 1, &connectionTaskHandle);
+  BLEDimmerWorker::instance().registerDimmer(this);
 #endif
 }
 
 BLEDimmer::~BLEDimmer() {
 #ifdef IOTSA_WITH_BLE_TASKS
-  if (connectionTaskHandle != nullptr) {
-    vTaskDelete(connectionTaskHandle);
-    connectionTaskHandle = nullptr;
-  }
+  BLEDimmerWorker::instance().unregisterDimmer(this);
 #endif
 }
 
@@ -38,26 +36,116 @@ bool BLEDimmer::isConnected() {
   return _ensureConnection() && dimmer->isConnected() && !_isDisconnecting;
 }
 
+int BLEDimmer::commandCost() {
+  // Already connected, then found by a scan or direct-connectable, then the rest.
+  if (cachedStatus.connected) return 0;
+  if (cachedStatus.available || knownAddress != "") return 1;
+  return 2;
+}
+
+bool BLEDimmer::updateStatus() {
+  Status newStatus;
+  newStatus.available = available();
+  newStatus.connecting = isConnecting();
+  newStatus.connected = isConnected();
+  newStatus.dataValid = _dataValid;
+  newStatus.pending = _changePending();
+  if (newStatus.available) {
+    // Remember the address a scan found, for getAddress() and for a direct connect next time.
+    String address = String(dimmer->getAddress().c_str());
+    if (address != "" && address != knownAddress) {
+      knownAddress = address;
+      identityChanges++;
+    }
+  }
+  bool changed = newStatus.available != cachedStatus.available
+    || newStatus.connecting != cachedStatus.connecting
+    || newStatus.connected != cachedStatus.connected
+    || newStatus.dataValid != cachedStatus.dataValid
+    || newStatus.pending != cachedStatus.pending;
+  if (cachedStatus.pending && !newStatus.pending && commandCompletedMillis == 0) {
+    // We gave up on the request: show what the dimmer actually has.
+    _rollbackToConfirmed();
+  }
+  cachedStatus = newStatus;
+  return changed;
+}
+
 void BLEDimmer::updateDimmer() {
-  if (!available()) {
+  updateDimmerFields(field_all);
+}
+
+void BLEDimmer::updateDimmerFields(int fields) {
+  if (fields == 0) return;
+  if (!_canTryConnect()) {
     IotsaSerial.printf("%s.updateDimmer() called but not available\n", name.c_str());
     return;
   }
   BLEDIMMER_DEBUG IotsaSerial.printf("%s.updateDimmer() called\n", name.c_str());
+  _recordCommand();
+  fastConnectFailed = false;
+  stateMatchesGeneration = false;
+  _publishWantedState();
+  commandCompletedMillis = 0;
+  fieldsToSend |= fields;
   needSyncToDevice = true;
+  // So the UI shows it as pending right away, not only after the next loop().
+  cachedStatus.pending = true;
+  needTransmitTimeoutAtMillis = millis() + unreachableGiveUpMillis;
+  if (callbacks) callbacks->dimmerValueChanged();
+  _wakeWorker(BLEDimmerWorker::class_interactive);
+}
+
+#ifdef IOTSA_WITH_BLE_TASKS
+void BLEDimmer::updateDimmerStreaming() {
+  if (!_canTryConnect()) {
+    IotsaSerial.printf("%s.updateDimmerStreaming() called but not available\n", name.c_str());
+    return;
+  }
+  // No need to queue anything: the task sends whatever level is current
+  // when it gets around to it, so a fast drag coalesces by itself.
+  _recordCommand();
+  fastConnectFailed = false;
+  stateMatchesGeneration = false;
+  _publishWantedState();
+  commandCompletedMillis = 0;
+  needStreamToDevice = true;
+  cachedStatus.pending = true;
   needTransmitTimeoutAtMillis = millis() + unreachableGiveUpMillis;
   if (callbacks) callbacks->dimmerValueChanged();
+  _wakeWorker(BLEDimmerWorker::class_interactive);
+}
+#endif
+
+void BLEDimmer::_recordCommand() {
+  // disconnectAtMillis belongs to the worker, but a stale value only misclassifies one hit.
+  uint32_t now = millis();
+  uint32_t disconnectAt = disconnectAtMillis;
+  bool connectionOpen = disconnectAt != 0 && (int32_t)(disconnectAt - now) > 0;
+  keepOpenModel.command(now, connectionOpen, bleClientMod.maxConnectionKeepOpen());
 }
 
 bool BLEDimmer::setName(String value) {
   if (value == name) return false;
+#ifdef IOTSA_WITH_BLE_TASKS
+  // The worker may be using the connection and the cache we are about to drop.
+  BLEDimmerWorker::instance().holdDimmer(this);
+#endif
   if (name) bleClientMod.delDevice(name);
   if (dimmer) {
     dimmer->clearDevice();
     dimmer = nullptr;
   }
+  gattCache.invalidate();
+  haveGeneration = false;
+  stateMatchesGeneration = false;
+  _statusChanged = true;
   name = value;
+  identityChanges++;
   if (value) bleClientMod.addDevice(name);
+#ifdef IOTSA_WITH_BLE_TASKS
+  BLEDimmerWorker::instance().releaseDimmer();
+#endif
   return true;
 }
 void BLEDimmer::formHandler_fields(String& message, const String& text, const String& f_name, bool includeConfig) {
@@ -70,6 +158,7 @@ void BLEDimmer::formHandler_fields(String& message, const String& text, const St
     _ensureConnection();
     if (dimmer && dimmer->available()) {
       message += "BLE device address: " + String(dimmer->getAddress().c_str()) + "<br>";
+      message += gattCache.info() + "<br>";
     } else {
       message += "<em>BLE device not available</em><br>";
     }
@@ -83,6 +172,9 @@ bool BLEDimmer::BLEDimmer::configLoad(IotsaConfigFileLoad& cf, const String& n_n
   if (address != "") {
     bleClientMod.noteKnownAddress(name, address);
   }
+  if (address != knownAddress) identityChanges++;
+  knownAddress = address;
+  gattCache.configLoad(cf, n_name, knownAddress);
   return rv;
 }
 
@@ -92,7 +184,16 @@ void BLEDimmer::configSave(IotsaConfigFileSave& cf, const String& n_name) {
   _ensureConnection();
   if (dimmer) {
     String address = String(dimmer->getAddress().c_str());
-    if (address != "") cf.put(n_name + ".address", address);
+    if (address != "" && address != knownAddress) {
+      knownAddress = address;
+      identityChanges++;
+    }
+  }
+  // Save the address even if we haven't seen the device this session,
+  // otherwise the next boot would have to scan for it again.
+  if (knownAddress != "") {
+    cf.put(n_name + ".address", knownAddress);
+    if (gattCache.matches(knownAddress.c_str())) gattCache.configSave(cf, n_name);
   }
   AbstractDimmer::configSave(cf, n_name);
 }
@@ -102,15 +203,34 @@ void BLEDimmer::getHandler(JsonObject& reply) {
     std::string address = dimmer->getAddress();
     if (address != "") reply["address"] = String(address.c_str());
   }
+  static const char *phaseNames[] = { "disconnected", "interactive", "idle" };
+  reply["connPhase"] = phaseNames[connPhase];
+  NimBLEClient *client = _getClient(false);
+  if (connPhase != phase_disconnected && client != nullptr && client->isConnected()) {
+    NimBLEConnInfo connInfo = client->getConnInfo();
+    reply["connInterval"] = connInfo.getConnInterval() * 1.25;
+    reply["connLatency"] = connInfo.getConnLatency();
+    reply["connTimeout"] = connInfo.getConnTimeout() * 10;
+  }
+  if (haveGeneration) reply["generation"] = lastGeneration;
+  reply["lostUpdates"] = lostUpdates;
+  JsonObject preconnectReply = reply["preconnect"].to<JsonObject>();
+  preconnectReply["count"] = preconnects;
+  preconnectReply["used"] = preconnectsUsed;
+  preconnectReply["abandoned"] = preconnectsAbandoned;
+  JsonObject keepOpenReply = reply["keepOpen"].to<JsonObject>();
+  keepOpenModel.getHandler(keepOpenReply);
   AbstractDimmer::getHandler(reply);
 }
 
 void BLEDimmer::setup() {
   if (listenForDeviceChanges) {
-    if (available()) {
+    if (_canTryConnect()) {
+      fastConnectFailed = false;
       needSyncFromDevice = listenForDeviceChanges;
       _dataValid = false;
       needTransmitTimeoutAtMillis = millis() + unreachableGiveUpMillis;
+      _wakeWorker(BLEDimmerWorker::class_background);
     }
   } else {
     _dataValid = true;
@@ -119,19 +239,48 @@ void BLEDimmer::setup() {
 
 void BLEDimmer::refresh() {
   if (listenForDeviceChanges) {
+    fastConnectFailed = false;
+    needSyncFromDevice = listenForDeviceChanges;   
+    _wakeWorker(BLEDimmerWorker::class_selected);
+  } else {
+    _dataValid = true;
+  }
+}
+
+void BLEDimmer::refreshInBackground() {
+  if (listenForDeviceChanges) {
+    fastConnectFailed = false;
     needSyncFromDevice = listenForDeviceChanges;   
+    _wakeWorker(BLEDimmerWorker::class_background);
   } else {
     _dataValid = true;
   }
 }
 
+void BLEDimmer::preconnect() {
+#ifdef IOTSA_WITH_BLE_TASKS
+  if (!_canTryConnect()) return;
+  // Already connected or connecting: the command will be quick anyway.
+  if (isConnected() || hasPendingWork()) return;
+  BLEDIMMER_DEBUG IotsaSerial.printf("%s.preconnect() called\n", name.c_str());
+  preconnects++;
+  fastConnectFailed = false;
+  needTransmitTimeoutAtMillis = millis() + unreachableGiveUpMillis;
+  needPreconnect = true;
+  iotsaConfig.postponeSleep(preconnectKeepOpenMillis+1000);
+  _wakeWorker(BLEDimmerWorker::class_interactive);
+#endif
+}
+
 void BLEDimmer::followDimmerChanges(bool follow) { 
   listenForDeviceChanges = follow; 
   if (listenForDeviceChanges) {
-    if (available()) {
+    if (_canTryConnect()) {
+      fastConnectFailed = false;
       needSyncFromDevice = listenForDeviceChanges;
       _dataValid = false;
       needTransmitTimeoutAtMillis = millis() + unreachableGiveUpMillis;
+      _wakeWorker(BLEDimmerWorker::class_background);
     }
   } else {
     _dataValid = true;
@@ -145,241 +294,440 @@ void BLEDimmer::identify() {
 
 
 #ifdef IOTSA_WITH_BLE_TASKS
-void BLEDimmer::_connectionTask(void *arg) {
-  BLEDimmer *_this = reinterpret_cast<BLEDimmer *>(arg);
-  _this->connectionTask();
-}
-
-void BLEDimmer::connectionTask() {
-  IotsaSerial.printf("BLEDimmer: %d: connection task created\n", num);
-  uint32_t maxWaitMs = 1000;
-  while(true) {
-    auto v = ulTaskNotifyTake(0, pdMS_TO_TICKS(maxWaitMs));
-    maxWaitMs = 1000; // May be lowered by the code below.
-    if (!needSyncToDevice && !needSyncFromDevice) {
-
-    // But we first disconnect if we are connected-idle for long enough.
-      if (disconnectAtMillis > 0 && millis() > disconnectAtMillis) {
-        if (_ensureConnection()) {
-          _isDisconnecting = true;
-          _isConnecting = false;
-          dimmer->disconnect();
-          BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: disconnect from %s\n", name.c_str());
-        }
-        _availableChanged = true;
-        disconnectAtMillis = 0;
-      }
-      continue; // Nothing to do, next time through the loop
-    }
-    // We have something to transmit/receive. Check whether our dimmer actually exists.
-    if (!_ensureConnection()) {
-      IotsaSerial.printf("BLEDimmer: Skip connection to nonexistent dimmer %d %s\n", num, name.c_str());
-      needSyncToDevice = false;
-      needSyncFromDevice = false;
-      _availableChanged = true;
-      continue;
-    }
-    // If it exists, check that we have enough information to connect.
-    if (!dimmer->available()) {
-      //IotsaSerial.println("xxxjack dimmer not available");
-      if (millis() > needTransmitTimeoutAtMillis) {
-        IotsaSerial.printf("BLEDimmer: Giving up on connecting to %s\n", name.c_str());
-        needSyncToDevice = false;
-        needSyncFromDevice = false;
-        continue;
-      }
-      maxWaitMs = 20;
-    }
-    if (!dimmer->isConnected()) {
-      if (dimmer->isDisconnecting()) {
-        // Previous disconnect() hasn't been confirmed complete yet.
-        // NimBLEClient::connect() hard-rejects while it's still settling --
-        // wait for it rather than trying and failing.
-        maxWaitMs = 20;
-        continue;
-      }
-      // Connecting and scanning are mutually exclusive on this stack, so
-      // wanting to connect actively stops any in-progress scan rather than
-      // waiting for it to end on its own (see cwi-dis/iotsa#143 -- this
-      // really belongs in IotsaBLEClientConnection, not here).
-      bleClientMod.requestStopScanningForConnect();
-      if (!bleClientMod.canConnect()) {
-        if (millis() > noWarningPrintBefore) {
-          IotsaSerial.printf("BLEDimmer: BLE busy, cannot connect to %s\n", name.c_str());
-          noWarningPrintBefore = millis() + 4000;
-        }
-        continue;
-      }
-      noWarningPrintBefore = 0;
-      // If all that is correct, try to connect.
-      _isDisconnecting = false;
-      _isConnecting = true;
-      _availableChanged = true;
-      BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: connecting to %s\n", dimmer->getName().c_str());
-      if (!dimmer->connect()) {
-        BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: connect to %s failed\n", dimmer->getName().c_str());
-        _isConnecting = false;
-        needSyncFromDevice = false;
-        needSyncToDevice = false;
-        bleClientMod.deviceNotConnectable(name); // xxxjack good idea?
-        _availableChanged = true;
-        continue;
-      }
-      BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: connected to %s\n", dimmer->getName().c_str());
-      _availableChanged = true;
-    }
-    
-    if (needSyncFromDevice) {
-      _syncFromDevice();
-    }
-    if (needSyncToDevice) {
-      _syncToDevice();
-    }
-    uint32_t keepOpen = min(stayConnectedMillis, (uint32_t)bleClientMod.maxConnectionKeepOpen());
-    disconnectAtMillis = millis() + keepOpen;
-    iotsaConfig.postponeSleep(keepOpen+1000);
-    BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: keepopen %d\n", keepOpen);
-  }
-}
-#endif
-
-void BLEDimmer::loop() {
-#ifdef IOTSA_WITH_BLE_TASKS
-  if (_availableChanged) {
-    _availableChanged = false;
-    callbacks->dimmerAvailableChanged();
+uint32_t BLEDimmer::connectionStep() {
+  // Called by the BLEDimmerWorker task when we have posted a job or our
+  // timer has expired. Does whatever connect/sync/disconnect work is due and
+  // returns when it wants to be called again (in ms), or 0 for "not until
+  // there is a new job".
+  uint32_t now = millis();
+  if (streamFinalAtMillis > 0 && !needStreamToDevice && now >= streamFinalAtMillis) {
+    // Streaming has settled. Send the final state with acknowledgement,
+    // so dataValid() reflects what the dimmer actually has.
+    streamFinalAtMillis = 0;
+    fieldsToSend |= field_all;
+    needSyncToDevice = true;
   }
-  if (_dataValidChanged) {
-    _dataValidChanged = false;
-    callbacks->dimmerValueChanged();
-  }
-#else
-  // If we don't have anything to transmit we bail out quickly...
-  if (!needSyncToDevice && !needSyncFromDevice) {
-
-    // But we first disconnect if we are connected-idle for long enough.
-    if (disconnectAtMillis > 0 && millis() > disconnectAtMillis) {
+  if (!needSyncToDevice && !needSyncFromDevice && !needStreamToDevice && !needPreconnect) {
+    if (streamFinalAtMillis > 0) {
+      return streamFinalAtMillis - now;
+    }
+    // Nothing to transmit, but we disconnect if we are connected-idle for long enough.
+    if (disconnectAtMillis == 0) return 0;
+    if (now > disconnectAtMillis) {
       if (_ensureConnection()) {
         _isDisconnecting = true;
         _isConnecting = false;
         dimmer->disconnect();
         BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: disconnect from %s\n", name.c_str());
       }
-      callbacks->dimmerAvailableChanged();
+      connPhase = phase_disconnected;
+      _availableChanged = true;
       disconnectAtMillis = 0;
+      if (preconnectUnused) {
+        preconnectUnused = false;
+        preconnectsAbandoned++;
+      }
+      return 0;
     }
-    return;
+    if (connPhase == phase_interactive) {
+      // Kept open but no commands for a while: move to low-power parameters.
+      uint32_t idleAt = lastCommandMillis + Lissabon::Dimmer::connIdleAfterMillis;
+      if (now >= idleAt) {
+        _setConnPhase(phase_idle);
+      } else {
+        return min(idleAt, disconnectAtMillis + 1) - now;
+      }
+    }
+    return disconnectAtMillis + 1 - now;
   }
   // We have something to transmit/receive. Check whether our dimmer actually exists.
   if (!_ensureConnection()) {
     IotsaSerial.printf("BLEDimmer: Skip connection to nonexistent dimmer %d %s\n", num, name.c_str());
-    needSyncToDevice = false;
-    needSyncFromDevice = false;
-    return;
+    _cancelWork();
+    _availableChanged = true;
+    return 0;
   }
   // If it exists, check that we have enough information to connect.
+  // If we have a cached address we try a direct connect first, without
+  // waiting for the device to be seen by a scan.
+  _isFastConnecting = false;
   if (!dimmer->available()) {
     //IotsaSerial.println("xxxjack dimmer not available");
     if (millis() > needTransmitTimeoutAtMillis) {
       IotsaSerial.printf("BLEDimmer: Giving up on connecting to %s\n", name.c_str());
-      needSyncToDevice = false;
-      needSyncFromDevice = false;
-      return;
+      _cancelWork();
+      return 0;
     }
-    // iotsaBLEClient should be listening for advertisements
-    return;
+    if (!_fastConnectAllowed()) {
+      // Wait for a scan to find it.
+      return 20;
+    }
+    _isFastConnecting = true;
   }
-  // Now we can connect, unless we are already connected
   if (!dimmer->isConnected()) {
     if (dimmer->isDisconnecting()) {
       // Previous disconnect() hasn't been confirmed complete yet.
       // NimBLEClient::connect() hard-rejects while it's still settling --
       // wait for it rather than trying and failing.
-      return;
+      return 20;
     }
-    // If we are scanning we don't try to connect
+    // Connecting and scanning are mutually exclusive on this stack, so
+    // wanting to connect actively stops any in-progress scan rather than
+    // waiting for it to end on its own (see cwi-dis/iotsa#143 -- this
+    // really belongs in IotsaBLEClientConnection, not here).
+    bleClientMod.requestStopScanningForConnect();
     if (!bleClientMod.canConnect()) {
-      IotsaSerial.println("BLEDimmer: BLE busy, cannot connect");
       if (millis() > noWarningPrintBefore) {
         IotsaSerial.printf("BLEDimmer: BLE busy, cannot connect to %s\n", name.c_str());
         noWarningPrintBefore = millis() + 4000;
       }
-      return;
+      return 1000;
     }
     noWarningPrintBefore = 0;
     // If all that is correct, try to connect.
-    callbacks->dimmerAvailableChanged();
     _isDisconnecting = false;
     _isConnecting = true;
-    callbacks->dimmerAvailableChanged();
-    BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: conecting to %s\n", dimmer->getName().c_str());
+    _availableChanged = true;
+    BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: %sconnecting to %s\n", _isFastConnecting ? "direct " : "", dimmer->getName().c_str());
+    NimBLEClient *client = _getClient(_isFastConnecting);
+    if (client) {
+      client->setConnectTimeout(_isFastConnecting ? fastConnectTimeoutMillis : unreachableGiveUpMillis);
+      // We connect because we have a command to send, so start out fast.
+      const Lissabon::Dimmer::ConnParams& params = Lissabon::Dimmer::connParamsInteractive;
+      client->setConnectionParams(params.minInterval, params.maxInterval, params.latency, params.timeout);
+    }
+    connPhase = phase_disconnected;
     if (!dimmer->connect()) {
       BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: connect to %s failed\n", dimmer->getName().c_str());
       _isConnecting = false;
-      bleClientMod.deviceNotConnectable(name);
-      callbacks->dimmerAvailableChanged();
-      return;
+      if (_isFastConnecting) {
+        // Cached address didn't work (device asleep too long, out of range,
+        // or address changed). Keep the request and go back to waiting
+        // for an advertisement.
+        IotsaSerial.printf("BLEDimmer: direct connect to %s failed, falling back to scan\n", name.c_str());
+        fastConnectFailed = true;
+        _isFastConnecting = false;
+        _availableChanged = true;
+        return 20;
+      }
+      _cancelWork();
+      bleClientMod.deviceNotConnectable(name); // xxxjack good idea?
+      _availableChanged = true;
+      return 0;
     }
     BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: connected to %s\n", dimmer->getName().c_str());
-    callbacks->dimmerAvailableChanged();
-    return; // Return: next time through the loop we will send/receive data.
+    gattCache.newConnection();
+    // If the client didn't exist before connect() it connected with the stack
+    // defaults, and _setConnPhase() below will request our parameters.
+    if (client) connPhase = phase_interactive;
+    _availableChanged = true;
+  }
+  lastCommandMillis = millis();
+  _setConnPhase(phase_interactive);
+  bool onlyPreconnect = needPreconnect && !needSyncToDevice && !needSyncFromDevice && !needStreamToDevice;
+  needPreconnect = false;
+  if (onlyPreconnect) {
+    // Connected ahead of the command. Wait for it, but not too long.
+    preconnectUnused = true;
+    disconnectAtMillis = millis() + preconnectKeepOpenMillis;
+    iotsaConfig.postponeSleep(preconnectKeepOpenMillis+1000);
+    BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: preconnected to %s\n", name.c_str());
+    return min(preconnectKeepOpenMillis + 1, Lissabon::Dimmer::connIdleAfterMillis);
+  }
+  if (preconnectUnused) {
+    preconnectUnused = false;
+    preconnectsUsed++;
   }
   
   if (needSyncFromDevice) {
-    if(_syncFromDevice()) {
-      callbacks->dimmerValueChanged();
-    }
+    if (_syncFromDevice()) _dataValidChanged = true;
   }
   if (needSyncToDevice) {
+    // Acknowledged write of the full state, supersedes any streamed values.
+    needStreamToDevice = false;
+    streamFinalAtMillis = 0;
     _syncToDevice();
+  } else if (needStreamToDevice) {
+    needStreamToDevice = false;
+    _streamToDevice();
+    streamFinalAtMillis = millis() + streamSettleMillis;
   }
-  int keepOpen = min(stayConnectedMillis, bleClientMod.maxConnectionKeepOpen());
+  uint32_t keepOpen = min(keepOpenModel.keepOpenMillis(), (uint32_t)bleClientMod.maxConnectionKeepOpen());
+  // Don't drop the connection before the final write of a streamed change.
+  if (streamFinalAtMillis > 0 && keepOpen < streamSettleMillis + 100) keepOpen = streamSettleMillis + 100;
   disconnectAtMillis = millis() + keepOpen;
   iotsaConfig.postponeSleep(keepOpen+1000);
   BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: keepopen %d\n", keepOpen);
+  if (streamFinalAtMillis > 0) return streamSettleMillis;
+  return min(keepOpen + 1, Lissabon::Dimmer::connIdleAfterMillis);
+}
+
+void BLEDimmer::_cancelWork() {
+  if (needPreconnect && !needSyncToDevice && !needSyncFromDevice && !needStreamToDevice) {
+    // Nobody was waiting for this one, but it did cost us.
+    preconnectsAbandoned++;
+  }
+  needSyncToDevice = false;
+  fieldsToSend = 0;
+  needSyncFromDevice = false;
+  needStreamToDevice = false;
+  needPreconnect = false;
+  streamFinalAtMillis = 0;
+}
+
+void BLEDimmer::_setConnPhase(ConnPhase phase) {
+  if (phase == connPhase) return;
+  NimBLEClient *client = _getClient(false);
+  if (client == nullptr || !client->isConnected()) return;
+  const Lissabon::Dimmer::ConnParams& params = phase == phase_idle ? Lissabon::Dimmer::connParamsIdle : Lissabon::Dimmer::connParamsInteractive;
+  BLEDIMMER_DEBUG IotsaSerial.printf("BLEDimmer: %s: request %s connection parameters\n", name.c_str(), phase == phase_idle ? "idle" : "interactive");
+  client->updateConnParams(params.minInterval, params.maxInterval, params.latency, params.timeout);
+  connPhase = phase;
+}
+#endif
+
+void BLEDimmer::_publishWantedState() {
+  State state;
+  state.isOn = isOn;
+#ifdef DIMMER_WITH_LEVEL
+  if (level < 0) level = 0;
+  if (level > 1) level = 1;
+  state.level = level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  state.temperature = temperature;
+#endif
+  wantedState.write(state);
+}
+
+void BLEDimmer::_rollbackToConfirmed() {
+  if (confirmedState.version() == 0) return;
+  State state = confirmedState.read();
+  IotsaSerial.printf("%s: request not confirmed, back to device state\n", name.c_str());
+  isOn = state.isOn;
+#ifdef DIMMER_WITH_LEVEL
+  level = state.level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  temperature = state.temperature;
+#endif
+}
+
+void BLEDimmer::_applyReportedState() {
+  uint32_t version = reportedState.version();
+  if (version == appliedReportedVersion) return;
+  appliedReportedVersion = version;
+  // If the user changed something since, that is going to be sent to the
+  // device and wins over what we read from it.
+  if (needSyncToDevice || needStreamToDevice) return;
+  State state = reportedState.read();
+  isOn = state.isOn;
+#ifdef DIMMER_WITH_LEVEL
+  level = state.level;
 #endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  temperature = state.temperature;
+#endif
+  if (callbacks) callbacks->dimmerValueChanged();
+}
+
+void BLEDimmer::loop() {
+  _applyReportedState();
+  bool statusChanged = false;
+  if (_statusChanged.exchange(false)) {
+    statusChanged = updateStatus();
+  }
+  if (_availableChanged) {
+    _availableChanged = false;
+    statusChanged = false;
+    callbacks->dimmerAvailableChanged();
+  }
+  if (_dataValidChanged) {
+    _dataValidChanged = false;
+    statusChanged = false;
+    callbacks->dimmerValueChanged();
+  }
+  // Something the UI shows changed without an event of its own (e.g. "connecting").
+  if (statusChanged) callbacks->dimmerValueChanged();
+}
+
+template<typename T> bool BLEDimmer::_set(DimmerGattCache::Attr attr, BLEUUID& charUUID, T value, bool response) {
+  std::string address = dimmer->getAddress();
+  NimBLEClient *client = _getClient(false);
+  if (client && gattCache.matches(address)) {
+    int rv = gattCache.write(client, attr, (const uint8_t *)&value, sizeof(value), response);
+    if (rv == 0) return true;
+    if (!DimmerGattCache::isStaleHandleError(rv)) return false;
+    // Dimmer firmware must have changed. Forget the handles and use discovery.
+    IotsaSerial.printf("BLEDimmer: %s: cached handles stale (%d), rediscovering\n", name.c_str(), rv);
+    gattCache.invalidate();
+  }
+  // Without cached handles we always write with response: this is also
+  // what gets the handles discovered for the next (unacknowledged) write.
+  bool ok = dimmer->set(Lissabon::Dimmer::serviceUUID, charUUID, value);
+  // Discovery has been done by now, so this is cheap.
+  if (ok && !gattCache.valid()) gattCache.discover(client, address);
+  return ok;
+}
+
+template<typename T> bool BLEDimmer::_get(DimmerGattCache::Attr attr, BLEUUID& charUUID, T& value) {
+  std::string address = dimmer->getAddress();
+  NimBLEClient *client = _getClient(false);
+  if (client && gattCache.matches(address)) {
+    int rv = gattCache.read(client, attr, (uint8_t *)&value, sizeof(value));
+    if (rv == 0) return true;
+    if (!DimmerGattCache::isStaleHandleError(rv)) return false;
+    IotsaSerial.printf("BLEDimmer: %s: cached handles stale (%d), rediscovering\n", name.c_str(), rv);
+    gattCache.invalidate();
+  }
+  bool ok = dimmer->get(Lissabon::Dimmer::serviceUUID, charUUID, value);
+  if (ok && !gattCache.valid()) gattCache.discover(client, address);
+  return ok;
 }
 
 void BLEDimmer::_syncToDevice() {
   bool ok;
+  bool allOk = true;
   if (!_ensureConnection()) return;
+  // Clear the flag before taking the snapshot: an updateDimmer() after this
+  // point sets it again, so its value is sent by the next round.
+  needSyncToDevice = false;
+  int fields = fieldsToSend.exchange(0);
+  uint32_t wantedVersion = wantedState.version();
+  State wanted = wantedState.read();
+  // Fields the dimmer acknowledged: only those become confirmed.
+  int acked = 0;
 #ifdef DIMMER_WITH_LEVEL
   // Connected to dimmer.
-  if (level < 0) level = 0;
-  if (level > 1) level = 1;
-  Lissabon::Dimmer::Type_brightness levelValue = level * ((1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1);
-  IFDEBUG IotsaSerial.printf("%s.syncToDevice: Transmit brightness %f (%d)\n", name.c_str(), level, levelValue);
-  ok = dimmer->set(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::brightnessUUID, levelValue);
-  if (ok) {
-    _dataValid = true;
-  } else {
-    IFDEBUG IotsaSerial.println("BLEDimmer: set(brightness) failed");
-    _dataValid = false;
+  if (fields & field_level) {
+    Lissabon::Dimmer::Type_brightness levelValue = wanted.level * ((1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1);
+    IFDEBUG IotsaSerial.printf("%s.syncToDevice: Transmit brightness %f (%d)\n", name.c_str(), wanted.level, levelValue);
+    ok = _set(DimmerGattCache::attr_brightness, Lissabon::Dimmer::brightnessUUID, levelValue);
+    if (ok) {
+      _dataValid = true;
+      writesSinceGeneration++;
+      acked |= field_level;
+    } else {
+      IFDEBUG IotsaSerial.println("BLEDimmer: set(brightness) failed");
+      _dataValid = false;
+      allOk = false;
+    }
   }
 #endif
 #ifdef DIMMER_WITH_TEMPERATURE
-  Lissabon::Dimmer::Type_temperature temperatureValue = temperature;
-  IFDEBUG IotsaSerial.printf("BLEDimmer: Transmit temperature %d\n", temperatureValue);
-  ok = dimmer->set(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::temperatureUUID, (Lissabon::Dimmer::Type_temperature)temperatureValue);
-  if (!ok) {
-    IFDEBUG IotsaSerial.println("BLEDimmer: set(temperature) failed");
+  if (fields & field_temperature) {
+    Lissabon::Dimmer::Type_temperature temperatureValue = wanted.temperature;
+    IFDEBUG IotsaSerial.printf("BLEDimmer: Transmit temperature %d\n", temperatureValue);
+    ok = _set(DimmerGattCache::attr_temperature, Lissabon::Dimmer::temperatureUUID, (Lissabon::Dimmer::Type_temperature)temperatureValue);
+    if (ok) {
+      writesSinceGeneration++;
+      acked |= field_temperature;
+    } else {
+      IFDEBUG IotsaSerial.println("BLEDimmer: set(temperature) failed");
+      allOk = false;
+    }
   }
 #endif // DIMMER_WITH_TEMPERATURE
-  IFDEBUG IotsaSerial.printf("%s.syncToDevice: Transmit ison %d\n", name.c_str(), (int)isOn);
-  ok = dimmer->set(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::isOnUUID, (Lissabon::Dimmer::Type_isOn)isOn);
-  if (!ok) {
-    IFDEBUG IotsaSerial.println("BLEDimmer: set(isOn) failed");
+  if (fields & field_isOn) {
+    IFDEBUG IotsaSerial.printf("%s.syncToDevice: Transmit ison %d\n", name.c_str(), (int)wanted.isOn);
+    ok = _set(DimmerGattCache::attr_isOn, Lissabon::Dimmer::isOnUUID, (Lissabon::Dimmer::Type_isOn)wanted.isOn);
+    if (ok) {
+      writesSinceGeneration++;
+      acked |= field_isOn;
+    } else {
+      IFDEBUG IotsaSerial.println("BLEDimmer: set(isOn) failed");
+      allOk = false;
+    }
   }
   if (needIdentify) {
     IFDEBUG IotsaSerial.printf("%s.syncToDevice: Transmit identify\n", name.c_str());
-    ok = dimmer->set(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::identifyUUID, (Lissabon::Dimmer::Type_isOn)1);
+    ok = _set(DimmerGattCache::attr_identify, Lissabon::Dimmer::identifyUUID, (Lissabon::Dimmer::Type_identify)1);
     needIdentify = false;
     if (!ok) {
       IFDEBUG IotsaSerial.println("BLEDimmer: identify failed");
     }
 
   }
-  needSyncToDevice = false;
+  Lissabon::Dimmer::Type_generation generation;
+  if (allOk && _readGeneration(generation)) {
+    // Every write of ours bumped the generation once. If it went up by more,
+    // someone else changed the dimmer since we last looked, and we have just
+    // overwritten that change.
+    int32_t lost = (int32_t)(generation - lastGeneration - writesSinceGeneration);
+    if (haveGeneration && lost > 0) {
+      lostUpdates += lost;
+      IotsaSerial.printf("BLEDimmer: %s: overwrote %d concurrent change(s)\n", name.c_str(), lost);
+    }
+    lastGeneration = generation;
+    haveGeneration = true;
+    writesSinceGeneration = 0;
+    stateMatchesGeneration = true;
+  }
+  _confirmFields(wanted, acked);
+  if (allOk) {
+    // Not if a newer value came in meanwhile: that one hasn't been sent yet.
+    // updateDimmer() publishes before it clears commandCompletedMillis, so
+    // checking again after the store catches a publish in between.
+    if (wantedState.version() == wantedVersion) {
+      commandCompletedMillis = millis();
+      if (wantedState.version() != wantedVersion) commandCompletedMillis = 0;
+    }
+  }
+}
+
+void BLEDimmer::_confirmFields(const State& wanted, int acked) {
+  // Fields we didn't send keep what we knew of them. If we knew nothing
+  // yet, we only have a confirmed state once every field is acknowledged.
+  int allFields = field_isOn;
+#ifdef DIMMER_WITH_LEVEL
+  allFields |= field_level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  allFields |= field_temperature;
+#endif
+  if (acked == 0) return;
+  if (confirmedState.version() == 0 && (acked & allFields) != allFields) return;
+  State confirmed = confirmedState.version() == 0 ? wanted : confirmedState.read();
+  if (acked & field_isOn) confirmed.isOn = wanted.isOn;
+#ifdef DIMMER_WITH_LEVEL
+  if (acked & field_level) confirmed.level = wanted.level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  if (acked & field_temperature) confirmed.temperature = wanted.temperature;
+#endif
+  confirmedState.write(confirmed);
+}
+
+void BLEDimmer::_streamToDevice() {
+  // Intermediate value of a continuous change: write-without-response, and
+  // ignore failures. _syncToDevice() will send the final state later, and
+  // only that one affects _dataValid.
+  if (!_ensureConnection()) return;
+  State wanted = wantedState.read();
+#ifdef DIMMER_WITH_LEVEL
+  Lissabon::Dimmer::Type_brightness levelValue = wanted.level * ((1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1);
+  IFDEBUG IotsaSerial.printf("%s.streamToDevice: brightness %f (%d)\n", name.c_str(), wanted.level, levelValue);
+  if (_set(DimmerGattCache::attr_brightness, Lissabon::Dimmer::brightnessUUID, levelValue, false)) writesSinceGeneration++;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  Lissabon::Dimmer::Type_temperature temperatureValue = wanted.temperature;
+  if (_set(DimmerGattCache::attr_temperature, Lissabon::Dimmer::temperatureUUID, temperatureValue, false)) writesSinceGeneration++;
+#endif // DIMMER_WITH_TEMPERATURE
+  if (_set(DimmerGattCache::attr_isOn, Lissabon::Dimmer::isOnUUID, (Lissabon::Dimmer::Type_isOn)wanted.isOn, false)) writesSinceGeneration++;
+}
+
+bool BLEDimmer::_readGeneration(Lissabon::Dimmer::Type_generation& generation) {
+  // Older dimmer firmware doesn't have the characteristic. If the handle
+  // cache tells us so we don't even try, otherwise the read simply fails.
+  if (gattCache.matches(dimmer->getAddress()) && !gattCache.has(DimmerGattCache::attr_generation)) return false;
+  return _get(DimmerGattCache::attr_generation, Lissabon::Dimmer::generationUUID, generation);
+}
+
+void BLEDimmer::_wakeWorker(BLEDimmerWorker::JobClass jobClass) {
+  _statusChanged = true;
+#ifdef IOTSA_WITH_BLE_TASKS
+  BLEDimmerWorker::instance().post(this, jobClass);
+#endif
 }
 
 bool BLEDimmer::_ensureConnection() {
@@ -388,17 +736,54 @@ bool BLEDimmer::_ensureConnection() {
   return dimmer != nullptr;
 }
 
+bool BLEDimmer::_canTryConnect() {
+  return available() || (_ensureConnection() && knownAddress != "");
+}
+
+bool BLEDimmer::_fastConnectAllowed() {
+  return knownAddress != "" && !fastConnectFailed;
+}
+
+NimBLEClient *BLEDimmer::_getClient(bool create) {
+  // The NimBLE client for our peer, so we can tune things the iotsa
+  // connection object doesn't expose. IotsaBLEClientConnection::connect()
+  // reuses an existing client for the peer address, so creating it here
+  // (for a direct connect, before any scan has found the device) is safe.
+  std::string address;
+  if (_ensureConnection()) address = dimmer->getAddress();
+  if (address == "") address = knownAddress.c_str();
+  if (address == "") return nullptr;
+  NimBLEAddress peer(address, BLE_ADDR_PUBLIC);
+  NimBLEClient *client = NimBLEDevice::getClientByPeerAddress(peer);
+  if (client == nullptr && create) {
+    client = NimBLEDevice::createClient(peer);
+  }
+  return client;
+}
+
 bool BLEDimmer::_syncFromDevice() {
   if (!_ensureConnection()) return false;
   bool ok;
   bool _gotAllData = true;
+  Lissabon::Dimmer::Type_generation generation;
+  bool gotGeneration = _readGeneration(generation);
+  if (gotGeneration && haveGeneration && stateMatchesGeneration && generation == lastGeneration) {
+    // Nothing changed since we last synced, so no need to read everything.
+    IFDEBUG IotsaSerial.printf("%s.syncFromDevice: generation %u unchanged\n", name.c_str(), generation);
+    bool changed = !_dataValid;
+    _dataValid = true;
+    needSyncFromDevice = false;
+    return changed;
+  }
+  // Fields we fail to read keep their wanted value, but then we don't report at all.
+  State reported = wantedState.read();
 #ifdef DIMMER_WITH_LEVEL
   // Connected to dimmer.
   Lissabon::Dimmer::Type_brightness levelValue;
-  ok = dimmer->get(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::brightnessUUID, levelValue);
+  ok = _get(DimmerGattCache::attr_brightness, Lissabon::Dimmer::brightnessUUID, levelValue);
   if (ok) {
-    level = (float)levelValue / (float)((1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1);
-    IFDEBUG IotsaSerial.printf("%s.syncFromDevice: Received brightness %f (%d)\n", name.c_str(), level, levelValue);
+    reported.level = (float)levelValue / (float)((1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1);
+    IFDEBUG IotsaSerial.printf("%s.syncFromDevice: Received brightness %f (%d)\n", name.c_str(), reported.level, levelValue);
   } else {
     IFDEBUG IotsaSerial.printf("%s.syncFromDevice: get(brightness) failed\n", name.c_str());
     _gotAllData = false;
@@ -406,25 +791,36 @@ bool BLEDimmer::_syncFromDevice() {
 #endif
 #ifdef DIMMER_WITH_TEMPERATURE
   Lissabon::Dimmer::Type_temperature temperatureValue;
-  ok = dimmer->get(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::temperatureUUID, temperatureValue);
+  ok = _get(DimmerGattCache::attr_temperature, Lissabon::Dimmer::temperatureUUID, temperatureValue);
   if (ok) {
-    temperature = (float)temperatureValue;
-    IFDEBUG IotsaSerial.printf("%s.syncFromDevice: Received temperature %f (%d)\n", name.c_str(), temperature, temperatureValue);
+    reported.temperature = (float)temperatureValue;
+    IFDEBUG IotsaSerial.printf("%s.syncFromDevice: Received temperature %f (%d)\n", name.c_str(), reported.temperature, temperatureValue);
   } else {
     // Temperature is optional
     IFDEBUG IotsaSerial.printf("%s.syncFromDevice: get(temperature) failed\n", name.c_str());
   }
 #endif // DIMMER_WITH_TEMPERATURE
-  uint8_t isOnValue;
-  ok = dimmer->get(Lissabon::Dimmer::serviceUUID, Lissabon::Dimmer::isOnUUID, isOnValue);
+  Lissabon::Dimmer::Type_isOn isOnValue;
+  ok = _get(DimmerGattCache::attr_isOn, Lissabon::Dimmer::isOnUUID, isOnValue);
   if (ok) {
     IFDEBUG IotsaSerial.printf("%s.syncFromDevice: received isOn %d\n", name.c_str(), isOnValue);
-    isOn = isOnValue;
+    reported.isOn = isOnValue;
   } else {
     _gotAllData = false;
     IFDEBUG IotsaSerial.printf("%s.syncFromDevice: get(isOn) failed\n", name.c_str());
   }
+  if (_gotAllData) {
+    confirmedState.write(reported);
+    reportedState.write(reported);
+  }
   _dataValid = _gotAllData;
+  if (_gotAllData && gotGeneration) {
+    // If something changed while we were reading we'll just do a full read next time.
+    lastGeneration = generation;
+    haveGeneration = true;
+    writesSinceGeneration = 0;
+    stateMatchesGeneration = true;
+  }
   needSyncFromDevice = false;
   return _gotAllData;
 }
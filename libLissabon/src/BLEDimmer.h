@@ -6,8 +6,14 @@
 #include "iotsa.h"
 #include "iotsaConfigFile.h"
 #include "iotsaBLEClient.h"
+#include <NimBLEDevice.h>
 #include "AbstractDimmer.h"
 #include "LissabonBLE.h"
+#include "DimmerGattCache.h"
+#include "KeepOpenModel.h"
+#include "BLEDimmerWorker.h"
+#include "Seqlock.h"
+#include <atomic>
 
 #define IOTSA_WITH_BLE_TASKS
 
@@ -19,12 +25,37 @@ public:
   ~BLEDimmer();
   void followDimmerChanges(bool follow);
   void updateDimmer();
+  void updateDimmerFields(int fields) override;
+#ifdef IOTSA_WITH_BLE_TASKS
+  void updateDimmerStreaming() override;
+#endif
   bool available() override;
   bool isConnected();
-  bool isConnecting() { return _isConnecting || needSyncFromDevice || needSyncToDevice; }
+  bool isConnecting() { return _isConnecting || needSyncFromDevice || needSyncToDevice || needStreamToDevice; }
   void refresh();
+  // Like refresh(), but for a dimmer the user isn't looking at: may be held
+  // off while user commands are being handled.
+  void refreshInBackground();
+  void preconnect() override;
   bool dataValid() override { return _dataValid; }
+  // Summary of the above for the UI, which reads it for every dimmer in
+  // every loop. Recomputed by updateStatus() only when something happened
+  // (connection work done, command given, scan result), because available()
+  // and friends may have to look up the device by name.
+  struct Status {
+    bool available : 1;
+    bool connecting : 1;
+    bool connected : 1;
+    bool dataValid : 1;
+    // A change was requested (the public fields) that the device hasn't confirmed yet.
+    bool pending : 1;
+  };
+  Status status() { return cachedStatus; }
+  // Returns true if the status changed. Main task only.
+  bool updateStatus();
   bool setName(String value);
+  String getAddress() override { return knownAddress; }
+  int commandCost() override;
   void setup() override;
   void loop() override;
   void identify() override;
@@ -33,26 +64,119 @@ public:
   virtual void getHandler(JsonObject& reply) override;
   virtual void formHandler_fields(String& message, const String& text, const String& f_name, bool includeConfig) override;
 protected:
+  // Saves our address and handles before a deep sleep.
+  friend class DeepSleepRemote;
 #ifdef IOTSA_WITH_BLE_TASKS
-  static void _connectionTask(void *arg);
-  void connectionTask();
-  TaskHandle_t connectionTaskHandle;
-  bool _availableChanged;
-  bool _dataValidChanged;
+  friend class BLEDimmerWorker;
+  uint32_t connectionStep();
+  // When the worker should call connectionStep() again (0: no timer), only
+  // accessed with the worker's lock held.
+  uint32_t workerWakeAtMillis = 0;
+  // Set if a job could not be queued, the worker treats it as a due timer.
+  volatile bool workerPending = false;
+  // Most urgent class of the work we have posted, and since when it is waiting.
+  volatile BLEDimmerWorker::JobClass pendingClass = BLEDimmerWorker::class_none;
+  volatile uint32_t pendingSinceMillis = 0;
+  bool hasPendingWork() { return needSyncToDevice || needSyncFromDevice || needStreamToDevice || needPreconnect || streamFinalAtMillis > 0; }
+  std::atomic<bool> _availableChanged{false};
+  std::atomic<bool> _dataValidChanged{false};
 #endif
   IotsaBLEClientConnection *dimmer = nullptr;
   bool _ensureConnection();
+  // Tell the worker we have set one of the need* flags.
+  void _wakeWorker(BLEDimmerWorker::JobClass jobClass);
+  Status cachedStatus = {};
+  // Set (also by the worker) when cachedStatus may be out of date, loop() recomputes it.
+  std::atomic<bool> _statusChanged{true};
+  bool _canTryConnect();
+  bool _fastConnectAllowed();
+  NimBLEClient *_getClient(bool create);
+  template<typename T> bool _set(DimmerGattCache::Attr attr, BLEUUID& charUUID, T value, bool response=true);
+  template<typename T> bool _get(DimmerGattCache::Attr attr, BLEUUID& charUUID, T& value);
+  // Attribute handles from an earlier connection, so we can skip discovery.
+  DimmerGattCache gattCache;
+  // Which connection parameters we last requested for the current connection.
+  enum ConnPhase { phase_disconnected, phase_interactive, phase_idle };
+  ConnPhase connPhase = phase_disconnected;
+  void _setConnPhase(ConnPhase phase);
+  uint32_t lastCommandMillis = 0;
+  // Chooses the keep-open window from the gaps between user commands.
+  KeepOpenModel keepOpenModel;
+  void _recordCommand();
   void _syncToDevice();
+  void _streamToDevice();
   bool _syncFromDevice();
+  bool _readGeneration(Lissabon::Dimmer::Type_generation& generation);
+  // The public level/isOn/temperature fields belong to the main task (UI,
+  // REST). The connection work runs in the BLEDimmerWorker task, and gets
+  // them through wantedState (published by updateDimmer()), and returns
+  // values read from the device through reportedState (applied by loop()).
+  // The flags below are shared between the two tasks, hence atomic.
+  struct State {
+    bool isOn;
+#ifdef DIMMER_WITH_LEVEL
+    float level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+    float temperature;
+#endif
+  };
+  Seqlock<State> wantedState;
+  Seqlock<State> reportedState;
+  uint32_t appliedReportedVersion = 0;
+  // Last state the device is known to have: written by us and acknowledged,
+  // or read from it. A request that fails is rolled back to this.
+  Seqlock<State> confirmedState;
+  bool _changePending() { return needSyncToDevice || needStreamToDevice || streamFinalAtMillis > 0; }
+  void _rollbackToConfirmed();
+  // Record the acknowledged fields (AbstractDimmer::Field) of wanted in confirmedState.
+  void _confirmFields(const State& wanted, int acked);
+  void _publishWantedState();
+  void _applyReportedState();
   IotsaBLEClientMod& bleClientMod;
   bool listenForDeviceChanges = false;
-  bool needSyncToDevice = false;
-  bool needSyncFromDevice = false;
-  bool _dataValid = false;
-  bool needIdentify = false;
+  std::atomic<bool> needSyncToDevice{false};
+  // Which fields (AbstractDimmer::Field) the next _syncToDevice() writes.
+  std::atomic<int> fieldsToSend{0};
+  std::atomic<bool> needSyncFromDevice{false};
+  // Intermediate value from updateDimmerStreaming() waiting to be sent
+  // (write-without-response, coalesced to the latest value).
+  std::atomic<bool> needStreamToDevice{false};
+  // When to follow up streamed values with an acknowledged write of the
+  // final state (0 if nothing was streamed since the last acknowledged write).
+  uint32_t streamFinalAtMillis = 0;
+  // How long the value must stay unchanged before we send that final write.
+  const uint32_t streamSettleMillis = 300;
+  std::atomic<bool> _dataValid{false};
+  std::atomic<bool> needIdentify{false};
+  // Connect without anything to send yet, because a command is probably coming.
+  std::atomic<bool> needPreconnect{false};
+  // The current connection was made by a preconnect and no command has used it yet.
+  bool preconnectUnused = false;
+  // How long a preconnected link waits for the command.
+  const uint32_t preconnectKeepOpenMillis = 3000;
+  // Preconnects started, used by a command, and given up on without a command.
+  // The last ones are what we pay for with no benefit.
+  uint32_t preconnects = 0;
+  uint32_t preconnectsUsed = 0;
+  uint32_t preconnectsAbandoned = 0;
+  // Drop all outstanding work (the device can't be reached).
+  void _cancelWork();
   bool _isConnecting = false;
   bool _isDisconnecting = false;
   uint32_t needTransmitTimeoutAtMillis = 0;
+  // Last state generation read from the device (see Lissabon::Dimmer::generationUUID).
+  Lissabon::Dimmer::Type_generation lastGeneration = 0;
+  bool haveGeneration = false;
+  // True if our state equals the device state at lastGeneration, so a
+  // refresh can skip the full read if the generation hasn't changed.
+  std::atomic<bool> stateMatchesGeneration{false};
+  // Our own writes since lastGeneration was read. Each bumps the device
+  // generation by one, so anything beyond that was someone else's change.
+  uint32_t writesSinceGeneration = 0;
+  // Changes made by someone else that we overwrote (two controllers
+  // writing at the same time).
+  uint32_t lostUpdates = 0;
   // How long to keep a pending updateDimmer()/followDimmerChanges() sync
   // request alive while the device's address is still unknown (i.e. it
   // hasn't yet been found by a discovery scan) before giving up on it.
@@ -68,12 +192,29 @@ protected:
   const uint32_t unreachableGiveUpMillis = 10000;
   uint32_t disconnectAtMillis = 0;
   uint32_t noWarningPrintBefore = 0;
+  // Address of the device as last persisted by configSave() (or learned
+  // from a scan this session). If we have one we don't wait for a fresh
+  // advertisement before connecting, we simply try a direct connect to
+  // the address. Only if that fails do we fall back to scan-then-connect.
+  String knownAddress;
+  // Set once the direct connect has been tried (and failed) for the current
+  // sync request, cleared when a new request comes in.
+  std::atomic<bool> fastConnectFailed{false};
+  // True while the current connect attempt is a direct (scanless) one.
+  bool _isFastConnecting = false;
+  // How long a direct connect to knownAddress may take before we give up
+  // on it and go back to scanning. A sleeping dimmer only accepts the
+  // connection when it next wakes to advertise, so this is above the longest
+  // sleep a dimmer may choose (Lissabon::Dimmer::maxSleepMillis).
+  const uint32_t fastConnectTimeoutMillis = Lissabon::Dimmer::directConnectTimeoutMillis;
 public:
   // How long to stay connected after a command, in case another one
   // follows immediately (e.g. dragging a brightness slider) -- avoids
   // paying the full discovery+connect cost again for a quick follow-up.
   // Also deliberately not configurable yet, same reasoning as
   // unreachableGiveUpMillis above (see cwi-dis/iotsa#144).
+  // This is now the fallback, keepOpenModel picks the window once it has
+  // seen enough commands.
   uint32_t stayConnectedMillis = 0;
 };
 };
@@ -0,0 +1,231 @@
+#include "iotsa.h"
+#ifdef IOTSA_WITH_BLE
+#include "BLEDimmerWorker.h"
+#include "BLEDimmer.h"
+#include <algorithm>
+
+#define WORKER_DEBUG if(0)
+
+namespace Lissabon {
+
+BLEDimmerWorker& BLEDimmerWorker::instance() {
+  static BLEDimmerWorker worker;
+  return worker;
+}
+
+BLEDimmerWorker::BLEDimmerWorker() {
+  for (int i=0; i<class_count; i++) {
+    jobQueues[i] = xQueueCreate(queueLength, sizeof(Job));
+  }
+  dimmersLock = xSemaphoreCreateMutex();
+  xTaskCreate(BLEDimmerWorker::_workerTask, "BLEDimmerWorker", stackSize, this, 1, &workerTaskHandle);
+}
+
+void BLEDimmerWorker::registerDimmer(BLEDimmer *dimmer) {
+  xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  dimmers.push_back(dimmer);
+  xSemaphoreGive(dimmersLock);
+}
+
+void BLEDimmerWorker::unregisterDimmer(BLEDimmer *dimmer) {
+  // Jobs for this dimmer may still be in the queue. runJob() ignores them
+  // because the dimmer is no longer registered.
+  holdDimmer(dimmer);
+  auto it = std::find(dimmers.begin(), dimmers.end(), dimmer);
+  if (it != dimmers.end()) dimmers.erase(it);
+  releaseDimmer();
+}
+
+void BLEDimmerWorker::holdDimmer(BLEDimmer *dimmer) {
+  xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  // Only waits if the worker is busy with this very dimmer.
+  while (runningDimmer == dimmer) {
+    xSemaphoreGive(dimmersLock);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  }
+}
+
+void BLEDimmerWorker::releaseDimmer() {
+  xSemaphoreGive(dimmersLock);
+}
+
+void BLEDimmerWorker::post(BLEDimmer *dimmer, JobClass jobClass) {
+  uint32_t now = millis();
+  // Not under the lock: at worst the worker resets these just after we set
+  // them, and the work is then not held off. Never the other way round.
+  if (jobClass < dimmer->pendingClass) dimmer->pendingClass = jobClass;
+  if (dimmer->pendingSinceMillis == 0) dimmer->pendingSinceMillis = now ? now : 1;
+  if (jobClass != class_background) lastUserMillis = now;
+  Job job = { dimmer, now };
+  if (xQueueSend(jobQueues[jobClass], &job, 0) != pdTRUE) {
+    // Queue full. The worker will get to it as a due timer.
+    queueFull++;
+    dimmer->workerPending = true;
+  } else {
+    uint32_t depth = 0;
+    for (int i=0; i<class_count; i++) depth += uxQueueMessagesWaiting(jobQueues[i]);
+    if (depth > maxQueueDepth) maxQueueDepth = depth;
+  }
+  xTaskNotifyGive(workerTaskHandle);
+}
+
+void BLEDimmerWorker::_workerTask(void *arg) {
+  BLEDimmerWorker *_this = reinterpret_cast<BLEDimmerWorker *>(arg);
+  _this->workerTask();
+}
+
+void BLEDimmerWorker::workerTask() {
+  IotsaSerial.println("BLEDimmerWorker: task created");
+  while(true) {
+    uint32_t delay = nextTimerDelay();
+    ulTaskNotifyTake(pdTRUE, delay == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(delay));
+    while (runOne()) {}
+  }
+}
+
+bool BLEDimmerWorker::runOne() {
+  // Queued jobs first, most urgent class first, then due timers.
+  // We go back to the queues after every job, so a user command has to wait
+  // for at most one job (or timer) that is already running.
+  Job job;
+  for (int i=0; i<class_count; i++) {
+    if (xQueueReceive(jobQueues[i], &job, 0) == pdTRUE) {
+      runJob(job.dimmer, (JobClass)i, false, job.postedMillis);
+      return true;
+    }
+  }
+  BLEDimmer *dimmer = nextDueTimer();
+  if (dimmer == nullptr) return false;
+  runJob(dimmer, dimmer->pendingClass, true, 0);
+  return true;
+}
+
+bool BLEDimmerWorker::shouldDeferBackground() {
+  if (uxQueueMessagesWaiting(jobQueues[class_interactive]) > 0) return true;
+  if (uxQueueMessagesWaiting(jobQueues[class_selected]) > 0) return true;
+  return lastUserMillis != 0 && millis() - lastUserMillis < backgroundHoldoffMillis;
+}
+
+uint32_t BLEDimmerWorker::nextTimerDelay() {
+  // Milliseconds until the first dimmer timer expires, UINT32_MAX if there are none.
+  uint32_t rv = UINT32_MAX;
+  uint32_t now = millis();
+  xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  for (auto d : dimmers) {
+    if (d->workerPending) {
+      rv = 0;
+      break;
+    }
+    if (d->workerWakeAtMillis == 0) continue;
+    uint32_t thisDelay = (int32_t)(d->workerWakeAtMillis - now) > 0 ? d->workerWakeAtMillis - now : 0;
+    if (thisDelay < rv) rv = thisDelay;
+  }
+  xSemaphoreGive(dimmersLock);
+  return rv;
+}
+
+BLEDimmer *BLEDimmerWorker::nextDueTimer() {
+  // Of all dimmers whose timer has expired, the one with the most urgent work.
+  BLEDimmer *rv = nullptr;
+  uint32_t now = millis();
+  xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  for (auto d : dimmers) {
+    if (d->workerPending || (d->workerWakeAtMillis != 0 && (int32_t)(now - d->workerWakeAtMillis) >= 0)) {
+      if (rv == nullptr || d->pendingClass < rv->pendingClass) rv = d;
+    }
+  }
+  xSemaphoreGive(dimmersLock);
+  return rv;
+}
+
+void BLEDimmerWorker::runJob(BLEDimmer *dimmer, JobClass jobClass, bool isTimer, uint32_t postedMillis) {
+  xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  if (std::find(dimmers.begin(), dimmers.end(), dimmer) == dimmers.end()) {
+    xSemaphoreGive(dimmersLock);
+    return;
+  }
+  uint32_t startMillis = millis();
+  if (isTimer) {
+    // Latency of a timer is measured from when it was due.
+    postedMillis = dimmer->workerWakeAtMillis != 0 ? dimmer->workerWakeAtMillis : startMillis;
+  }
+  // The dimmer's work may have been upgraded since this job was queued.
+  JobClass workClass = dimmer->hasPendingWork() ? dimmer->pendingClass : class_none;
+  if (workClass == class_background && shouldDeferBackground()) {
+    // Come back when the user has been quiet for a while, or earlier if
+    // the dimmer already wanted to (to disconnect, for example).
+    dimmer->workerPending = false;
+    uint32_t deferUntil = lastUserMillis + backgroundHoldoffMillis;
+    if (deferUntil == 0) deferUntil = 1;
+    uint32_t wakeAt = dimmer->workerWakeAtMillis;
+    bool wakeAtIsSooner = wakeAt != 0 && (int32_t)(wakeAt - startMillis) > 0 && (int32_t)(wakeAt - deferUntil) < 0;
+    if (!wakeAtIsSooner) dimmer->workerWakeAtMillis = deferUntil;
+    xSemaphoreGive(dimmersLock);
+    stats[class_background].deferred++;
+    WORKER_DEBUG IotsaSerial.printf("BLEDimmerWorker: defer background work for %d\n", dimmer->num);
+    return;
+  }
+  uint32_t pendingSinceMillis = dimmer->pendingSinceMillis;
+  dimmer->pendingSinceMillis = 0;
+  dimmer->workerPending = false;
+  dimmer->workerWakeAtMillis = 0;
+  runningDimmer = dimmer;
+  xSemaphoreGive(dimmersLock);
+  uint32_t wakeAfter = dimmer->connectionStep();
+  uint32_t endMillis = millis();
+  // unregisterDimmer() can't have returned for it while runningDimmer was set.
+  xSemaphoreTake(dimmersLock, portMAX_DELAY);
+  runningDimmer = nullptr;
+  if (wakeAfter > 0) {
+    dimmer->workerWakeAtMillis = endMillis + wakeAfter;
+    if (dimmer->workerWakeAtMillis == 0) dimmer->workerWakeAtMillis = 1;
+  }
+  if (!dimmer->hasPendingWork()) dimmer->pendingClass = class_none;
+  // Connecting, syncing or disconnecting may have changed what the UI shows.
+  dimmer->_statusChanged = true;
+  // Once we let go of the lock the dimmer may be unregistered and deleted.
+  int num = dimmer->num;
+  xSemaphoreGive(dimmersLock);
+
+  uint32_t runMillis = endMillis - startMillis;
+  if (workClass != class_none && pendingSinceMillis != 0) {
+    // First time the worker got to this work: record the queueing delay.
+    stats[workClass].add((int32_t)(startMillis - pendingSinceMillis) > 0 ? startMillis - pendingSinceMillis : 0, runMillis);
+  } else if (isTimer) {
+    timerStats.add((int32_t)(startMillis - postedMillis) > 0 ? startMillis - postedMillis : 0, runMillis);
+  }
+  WORKER_DEBUG IotsaSerial.printf("BLEDimmerWorker: %s %d for %d ran %d next %d\n", isTimer ? "timer" : "job", jobClass, num, runMillis, wakeAfter);
+}
+
+void BLEDimmerWorker::Stats::add(uint32_t waitMillis, uint32_t runMillis) {
+  count++;
+  totalWaitMillis += waitMillis;
+  if (waitMillis > maxWaitMillis) maxWaitMillis = waitMillis;
+  totalRunMillis += runMillis;
+  if (runMillis > maxRunMillis) maxRunMillis = runMillis;
+}
+
+void BLEDimmerWorker::getHandler(JsonObject& reply) {
+  static const char *classNames[] = { "interactive", "selected", "background", "timer" };
+  uint32_t depth = 0;
+  for (int i=0; i<class_count; i++) depth += uxQueueMessagesWaiting(jobQueues[i]);
+  reply["dimmers"] = dimmers.size();
+  reply["queueDepth"] = depth;
+  reply["maxQueueDepth"] = maxQueueDepth;
+  reply["queueFull"] = queueFull;
+  for (int i=0; i<=class_count; i++) {
+    Stats& s = i < class_count ? stats[i] : timerStats;
+    JsonObject classReply = reply[classNames[i]].to<JsonObject>();
+    classReply["count"] = s.count;
+    if (i == class_background) classReply["deferred"] = s.deferred;
+    if (s.count == 0) continue;
+    classReply["avgWait"] = s.totalWaitMillis / s.count;
+    classReply["maxWait"] = s.maxWaitMillis;
+    classReply["avgRun"] = s.totalRunMillis / s.count;
+    classReply["maxRun"] = s.maxRunMillis;
+  }
+}
+
+}
+#endif // IOTSA_WITH_BLE
@@ -0,0 +1,86 @@
+#ifndef _BLEDIMMERWORKER_H_
+#define _BLEDIMMERWORKER_H_
+//
+// Single task that does the BLE connect/sync/disconnect work for all
+// BLEDimmer objects, driven by job queues and per-dimmer timers.
+//
+#include "iotsa.h"
+#include <ArduinoJson.h>
+using namespace ArduinoJson;
+#include <vector>
+
+namespace Lissabon {
+
+class BLEDimmer;
+
+class BLEDimmerWorker {
+public:
+  // Jobs are run most urgent class first. Background work is also held
+  // off while the user is busy, so it doesn't occupy the radio when the
+  // next interactive command comes in.
+  enum JobClass {
+    class_interactive,  // user commands (updateDimmer(), slider streaming)
+    class_selected,     // refresh of the dimmer the user is looking at
+    class_background,   // refresh of other dimmers, followDimmerChanges()
+    class_count,
+    class_none = class_count
+  };
+  static BLEDimmerWorker& instance();
+  void registerDimmer(BLEDimmer *dimmer);
+  void unregisterDimmer(BLEDimmer *dimmer);
+  // For the main task, to change what the worker uses (the connection, the
+  // GATT cache): waits until the worker isn't running this dimmer, and keeps
+  // it from starting any job until releaseDimmer().
+  void holdDimmer(BLEDimmer *dimmer);
+  void releaseDimmer();
+  // Called from the main task. Never blocks: if the queue is full the
+  // dimmer is scheduled through its timer instead.
+  void post(BLEDimmer *dimmer, JobClass jobClass);
+  void getHandler(JsonObject& reply);
+protected:
+  BLEDimmerWorker();
+  static void _workerTask(void *arg);
+  void workerTask();
+  bool runOne();
+  void runJob(BLEDimmer *dimmer, JobClass jobClass, bool isTimer, uint32_t postedMillis);
+  bool shouldDeferBackground();
+  uint32_t nextTimerDelay();
+  BLEDimmer *nextDueTimer();
+  struct Job {
+    BLEDimmer *dimmer;
+    uint32_t postedMillis;
+  };
+  TaskHandle_t workerTaskHandle = nullptr;
+  QueueHandle_t jobQueues[class_count];
+  // Protects dimmers, runningDimmer (and the dimmers' workerWakeAtMillis).
+  // Not held during connectionStep(), which can take seconds.
+  SemaphoreHandle_t dimmersLock = nullptr;
+  std::vector<BLEDimmer *> dimmers;
+  // Dimmer whose connectionStep() is running. unregisterDimmer() waits
+  // until it is done with it, so it isn't deleted under the worker.
+  BLEDimmer *runningDimmer = nullptr;
+  // Last time interactive or selected-refresh work was posted.
+  volatile uint32_t lastUserMillis = 0;
+  // Fixed, independent of the number of dimmers.
+  static const int queueLength = 8;
+  static const uint32_t stackSize = 6000;
+  // How long after the last user command background work is held off.
+  static const uint32_t backgroundHoldoffMillis = 2000;
+  // Statistics, reported by getHandler(). For the job classes the wait is
+  // from the first post until the worker starts on the dimmer's work.
+  struct Stats {
+    uint32_t count = 0;
+    uint32_t totalWaitMillis = 0;
+    uint32_t maxWaitMillis = 0;
+    uint32_t totalRunMillis = 0;
+    uint32_t maxRunMillis = 0;
+    uint32_t deferred = 0;
+    void add(uint32_t waitMillis, uint32_t runMillis);
+  };
+  Stats stats[class_count];
+  Stats timerStats;
+  uint32_t queueFull = 0;
+  uint32_t maxQueueDepth = 0;
+};
+};
+#endif // _BLEDIMMERWORKER_H_
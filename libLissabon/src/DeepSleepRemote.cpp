@@ -0,0 +1,196 @@
+#include "DeepSleepRemote.h"
+#ifdef IOTSA_WITH_BLE
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
+namespace Lissabon {
+
+// Survives deep sleep, not power loss or a reset.
+struct RtcDimmer {
+  bool valid;
+  bool changedByFastPath; // isOn/level were set by the fast path, a full boot should use them
+  char address[18];
+  uint16_t handles[DimmerGattCache::attr_count];
+  bool isOn;
+  float level;
+  float minLevel;
+};
+
+struct RtcState {
+  uint32_t magic;
+  RtcDimmer dimmers[DeepSleepRemote::maxDimmers];
+  // Fast path statistics. Times are from the start of the application:
+  // the bootloader before that isn't included.
+  uint32_t fastWakes;
+  uint32_t fastFailures;
+  uint32_t lastWakeToCommandMicros;
+  uint64_t totalWakeToCommandMicros;
+  uint64_t totalAwakeMicros;
+};
+
+static const uint32_t rtcMagic = 0x4c534450;
+static RTC_DATA_ATTR RtcState rtcState;
+
+bool DeepSleepRemote::fastPathDone = false;
+
+void DeepSleepRemote::_init() {
+  if (rtcState.magic == rtcMagic) return;
+  memset(&rtcState, 0, sizeof(rtcState));
+  rtcState.magic = rtcMagic;
+}
+
+void DeepSleepRemote::save(int slot, BLEDimmer& dimmer) {
+  _init();
+  if (slot < 0 || slot >= maxDimmers) return;
+  RtcDimmer& d = rtcState.dimmers[slot];
+  d.valid = false;
+  d.changedByFastPath = false;
+  // Without handles we would have to do discovery, which is no faster than a full boot.
+  if (dimmer.knownAddress == "" || !dimmer.gattCache.matches(dimmer.knownAddress.c_str())) return;
+  strlcpy(d.address, dimmer.knownAddress.c_str(), sizeof(d.address));
+  dimmer.gattCache.getHandles(d.handles);
+  d.isOn = dimmer.isOn;
+#ifdef DIMMER_WITH_LEVEL
+  d.level = dimmer.level;
+  d.minLevel = dimmer.minLevel;
+#endif
+  d.valid = true;
+}
+
+bool DeepSleepRemote::wokeByUser() {
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+  return cause == ESP_SLEEP_WAKEUP_EXT0 || cause == ESP_SLEEP_WAKEUP_EXT1 || cause == ESP_SLEEP_WAKEUP_TOUCHPAD;
+}
+
+bool DeepSleepRemote::sendCommand(int slot, Command command, float step) {
+  _init();
+  if (slot < 0 || slot >= maxDimmers || !rtcState.dimmers[slot].valid) return false;
+  if (!_connectAndSend(slot, command, step)) {
+    // Don't try again with these handles: the full boot saves fresh ones.
+    rtcState.dimmers[slot].valid = false;
+    rtcState.fastFailures++;
+    return false;
+  }
+  uint32_t wakeToCommand = esp_timer_get_time();
+  rtcState.fastWakes++;
+  rtcState.lastWakeToCommandMicros = wakeToCommand;
+  rtcState.totalWakeToCommandMicros += wakeToCommand;
+  fastPathDone = true;
+  return true;
+}
+
+bool DeepSleepRemote::_connectAndSend(int slot, Command command, float step) {
+  RtcDimmer& d = rtcState.dimmers[slot];
+  NimBLEDevice::init("");
+  NimBLEAddress peer(std::string(d.address), BLE_ADDR_PUBLIC);
+  NimBLEClient *client = NimBLEDevice::createClient(peer);
+  if (client == nullptr) return false;
+  // As BLEDimmer: the dimmer may be light-sleeping.
+  client->setConnectTimeout(Lissabon::Dimmer::directConnectTimeoutMillis);
+  const Lissabon::Dimmer::ConnParams& params = Lissabon::Dimmer::connParamsInteractive;
+  client->setConnectionParams(params.minInterval, params.maxInterval, params.latency, params.timeout);
+  // No MTU exchange: our values are a few bytes, and it would cost a round trip.
+  if (!client->connect(true, false, false)) return false;
+  DimmerGattCache cache;
+  // The first read checks the handles against the dimmer's layout
+  // characteristic, so a reflashed dimmer makes us do a full boot.
+  bool ok = cache.setHandles(d.address, d.handles);
+  // Start from what the dimmer has now, someone else may have changed it while we slept.
+  Lissabon::Dimmer::Type_isOn isOnValue;
+  if (ok) ok = cache.read(client, DimmerGattCache::attr_isOn, (uint8_t *)&isOnValue, sizeof(isOnValue)) == 0;
+  bool isOn = ok ? isOnValue != 0 : d.isOn;
+#ifdef DIMMER_WITH_LEVEL
+  const float maxValue = (1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1;
+  Lissabon::Dimmer::Type_brightness levelValue;
+  if (ok) ok = cache.read(client, DimmerGattCache::attr_brightness, (uint8_t *)&levelValue, sizeof(levelValue)) == 0;
+  float level = ok ? levelValue / maxValue : d.level;
+  float newLevel = level;
+#endif
+  bool newIsOn = isOn;
+  switch (command) {
+  case command_toggle:
+    newIsOn = !isOn;
+    break;
+  case command_up:
+#ifdef DIMMER_WITH_LEVEL
+    if (isOn) newLevel = level + step > 1 ? 1 : level + step;
+#endif
+    newIsOn = true;
+    break;
+  case command_down:
+#ifdef DIMMER_WITH_LEVEL
+    if (isOn && level - step >= d.minLevel) {
+      newLevel = level - step;
+      break;
+    }
+#endif
+    newIsOn = false;
+    break;
+  }
+  bool sent = false;
+#ifdef DIMMER_WITH_LEVEL
+  if (ok && newLevel != level) {
+    levelValue = newLevel * maxValue;
+    ok = cache.write(client, DimmerGattCache::attr_brightness, (uint8_t *)&levelValue, sizeof(levelValue)) == 0;
+    if (ok) {
+      level = newLevel;
+      sent = true;
+    }
+  }
+#endif
+  if (ok && newIsOn != isOn) {
+    isOnValue = newIsOn;
+    ok = cache.write(client, DimmerGattCache::attr_isOn, (uint8_t *)&isOnValue, sizeof(isOnValue)) == 0;
+    if (ok) {
+      isOn = newIsOn;
+      sent = true;
+    }
+  }
+  client->disconnect();
+  // Once something was written the command has taken effect, at least in
+  // part: falling back to a full boot would do it a second time.
+  if (!ok && !sent) return false;
+  if (!ok) {
+    IFDEBUG IotsaSerial.printf("DeepSleepRemote: command to %s only partly sent\n", d.address);
+  }
+  d.isOn = isOn;
+#ifdef DIMMER_WITH_LEVEL
+  d.level = level;
+#endif
+  d.changedByFastPath = true;
+  return true;
+}
+
+void DeepSleepRemote::restore(int slot, BLEDimmer& dimmer) {
+  _init();
+  if (slot < 0 || slot >= maxDimmers) return;
+  RtcDimmer& d = rtcState.dimmers[slot];
+  if (!d.valid || !d.changedByFastPath) return;
+  d.changedByFastPath = false;
+  dimmer.isOn = d.isOn;
+#ifdef DIMMER_WITH_LEVEL
+  dimmer.level = d.level;
+#endif
+}
+
+void DeepSleepRemote::sleep() {
+  _init();
+  if (fastPathDone) rtcState.totalAwakeMicros += esp_timer_get_time();
+  esp_deep_sleep_start();
+}
+
+void DeepSleepRemote::getHandler(JsonObject& reply) {
+  _init();
+  reply["fastWakes"] = rtcState.fastWakes;
+  reply["fastFailures"] = rtcState.fastFailures;
+  if (rtcState.fastWakes == 0) return;
+  reply["lastWakeToCommandMillis"] = rtcState.lastWakeToCommandMicros / 1000.0;
+  reply["avgWakeToCommandMillis"] = rtcState.totalWakeToCommandMicros / 1000.0 / rtcState.fastWakes;
+  float avgAwakeMillis = rtcState.totalAwakeMicros / 1000.0 / rtcState.fastWakes;
+  reply["avgAwakeMillis"] = avgAwakeMillis;
+  // Estimate only: we can't measure the current, and the bootloader time isn't included.
+  reply["estimatedMilliAmpSecondsPerPress"] = avgAwakeMillis * activeMilliAmps / 1000.0;
+}
+
+};
+#endif // IOTSA_WITH_BLE
@@ -0,0 +1,48 @@
+#ifndef _DEEPSLEEPREMOTE_H_
+#define _DEEPSLEEPREMOTE_H_
+//
+// Fast path for battery remotes that deep sleep. A wakeup from deep sleep is
+// a reboot, and a full boot (config from SPIFFS, WiFi, scanning for the
+// dimmer) costs about a second at 100mA. So before sleeping we keep what we
+// need to talk to the dimmer (address, GATT handles, last state) in RTC
+// memory. On a button or touch wakeup setup() can then connect directly,
+// send the command and go back to sleep before the application is set up.
+// If anything fails we do a full boot, as without deep sleep.
+//
+#include "iotsa.h"
+#ifdef IOTSA_WITH_BLE
+#include "BLEDimmer.h"
+
+namespace Lissabon {
+
+class DeepSleepRemote {
+public:
+  enum Command {
+    command_toggle,
+    command_up,   // On, or one step brighter if already on
+    command_down  // One step dimmer, off if already at the minimum
+  };
+  static const int maxDimmers = 2;
+  // Call for each dimmer just before going to deep sleep after a full boot.
+  static void save(int slot, BLEDimmer& dimmer);
+  // True if we woke from deep sleep because of a button or touchpad.
+  static bool wokeByUser();
+  // Call at the start of setup(), before application.setup(). Returns true
+  // if the command was sent, the caller should then go back to sleep.
+  static bool sendCommand(int slot, Command command, float step=0.1);
+  // After a full boot: give the dimmer the state the fast path left it in.
+  static void restore(int slot, BLEDimmer& dimmer);
+  // Wake sources must have been set up by the caller. Doesn't return.
+  static void sleep();
+  // Wake-to-command time and estimated energy of the fast path wakes.
+  static void getHandler(JsonObject& reply);
+protected:
+  static bool _connectAndSend(int slot, Command command, float step);
+  static void _init();
+  // Current while awake, to estimate the energy used by a wakeup.
+  static const uint32_t activeMilliAmps = 100;
+  static bool fastPathDone;
+};
+};
+#endif // IOTSA_WITH_BLE
+#endif // _DEEPSLEEPREMOTE_H_
@@ -8,10 +8,12 @@ void DimmerBLEServer::setup() {
   // Set default advertising interval to be between 200ms and 600ms
   
   bleApi.setup(Lissabon::Dimmer::serviceUUIDstring, this);
+  // isOn, brightness and temperature also accept write-without-response,
+  // used by BLEDimmer for intermediate values while a slider is dragged.
 
   bleApi.addCharacteristic(
     Lissabon::Dimmer::isOnUUIDstring, 
-    BLE_READ|BLE_WRITE, 
+    BLE_READ|BLE_WRITE|NIMBLE_PROPERTY::WRITE_NR, 
     Lissabon::Dimmer::isOnUUID2904format, 
     Lissabon::Dimmer::isOnUUID2904unit, 
     Lissabon::Dimmer::isOnUUID2901
@@ -19,7 +21,7 @@ void DimmerBLEServer::setup() {
 #ifdef DIMMER_WITH_LEVEL
   bleApi.addCharacteristic(
     Lissabon::Dimmer::brightnessUUIDstring, 
-    BLE_READ|BLE_WRITE, 
+    BLE_READ|BLE_WRITE|NIMBLE_PROPERTY::WRITE_NR, 
     Lissabon::Dimmer::brightnessUUID2904format,
     Lissabon::Dimmer::brightnessUUID2904unit,
     Lissabon::Dimmer::brightnessUUID2901
@@ -28,7 +30,7 @@ void DimmerBLEServer::setup() {
 #ifdef DIMMER_WITH_TEMPERATURE
   bleApi.addCharacteristic(
     Lissabon::Dimmer::temperatureUUIDstring, 
-    BLE_READ|BLE_WRITE, 
+    BLE_READ|BLE_WRITE|NIMBLE_PROPERTY::WRITE_NR, 
     Lissabon::Dimmer::temperatureUUID2904format,
     Lissabon::Dimmer::temperatureUUID2904unit,
     Lissabon::Dimmer::temperatureUUID2901
@@ -41,54 +43,161 @@ void DimmerBLEServer::setup() {
     Lissabon::Dimmer::identifyUUID2904unit,
     Lissabon::Dimmer::identifyUUID2901
     );
+  bleApi.addCharacteristic(
+    Lissabon::Dimmer::generationUUIDstring, 
+    BLE_READ, 
+    Lissabon::Dimmer::generationUUID2904format,
+    Lissabon::Dimmer::generationUUID2904unit,
+    Lissabon::Dimmer::generationUUID2901
+    );
+  bleApi.addCharacteristic(
+    Lissabon::Dimmer::layoutUUIDstring, 
+    BLE_READ, 
+    Lissabon::Dimmer::layoutUUID2904format,
+    Lissabon::Dimmer::layoutUUID2904unit,
+    Lissabon::Dimmer::layoutUUID2901
+    );
 #endif
 }
 
+void DimmerBLEServer::loop() {
+  _handleCommands();
+  // Commands are coming in: ask for a short connection interval. Once they
+  // stop we ask for a long interval with peripheral latency, so we can sleep
+  // while the client keeps the connection open.
+  if (wantInteractive) {
+    wantInteractive = false;
+    if (!connIsInteractive) _setConnParams(true);
+  } else if (connIsInteractive && millis() > lastWriteMillis + Lissabon::Dimmer::connIdleAfterMillis) {
+    _setConnParams(false);
+  }
+}
+
+void DimmerBLEServer::_setConnParams(bool interactive) {
+  NimBLEServer *server = NimBLEDevice::getServer();
+  connIsInteractive = interactive;
+  if (server == nullptr) return;
+  const Lissabon::Dimmer::ConnParams& params = interactive ? Lissabon::Dimmer::connParamsInteractive : Lissabon::Dimmer::connParamsIdle;
+  for (uint16_t connHandle : server->getPeerDevices()) {
+    IFDEBUG IotsaSerial.printf("DimmerBLEServer: request %s connection parameters\n", interactive ? "interactive" : "idle");
+    server->updateConnParams(connHandle, params.minInterval, params.maxInterval, params.latency, params.timeout);
+  }
+}
+
+void DimmerBLEServer::getHandler(JsonObject& reply) {
+  NimBLEServer *server = NimBLEDevice::getServer();
+  reply["commandsQueued"] = commands.size();
+  reply["commandsHighWater"] = commands.highWater();
+  reply["commandsDropped"] = commands.overflows();
+  reply["connPhase"] = connIsInteractive ? "interactive" : "idle";
+  if (server == nullptr || server->getConnectedCount() == 0) {
+    reply["connPhase"] = "disconnected";
+    return;
+  }
+  NimBLEConnInfo connInfo = server->getPeerInfo(0);
+  reply["connInterval"] = connInfo.getConnInterval() * 1.25;
+  reply["connLatency"] = connInfo.getConnLatency();
+  reply["connTimeout"] = connInfo.getConnTimeout() * 10;
+}
+
+Lissabon::Dimmer::Type_layout DimmerBLEServer::_layoutHash() {
+  // Handles are only assigned when the server starts, so compute it when asked.
+  uint16_t handles[DimmerGattCache::attr_count] = {};
+  NimBLEService *service = NimBLEDevice::getServer()->getServiceByUUID(Lissabon::Dimmer::serviceUUID);
+  if (service) {
+    for (int i=0; i<DimmerGattCache::attr_count; i++) {
+      NimBLECharacteristic *characteristic = service->getCharacteristic(DimmerGattCache::attrUUID((DimmerGattCache::Attr)i));
+      if (characteristic) handles[i] = characteristic->getHandle();
+    }
+  }
+  return DimmerGattCache::layoutHash(handles);
+}
+
 bool DimmerBLEServer::blePutHandler(UUIDstring charUUID) {
-  bool anyChanged = false;
+  // Called in the NimBLE host task. Only decode the value here: the dimmer
+  // itself is changed in loop(), in the main task.
+  Command command;
+  lastWriteMillis = millis();
+  wantInteractive = true;
+  if (charUUID == Lissabon::Dimmer::isOnUUIDstring) {
+    command.type = Command::cmd_isOn;
+    command.value = bleApi.getAsInt(Lissabon::Dimmer::isOnUUIDstring);
 #ifdef DIMMER_WITH_LEVEL
-  if (charUUID == Lissabon::Dimmer::brightnessUUIDstring) {
-    int i_level = bleApi.getAsInt(Lissabon::Dimmer::brightnessUUIDstring);
-    float maxLevel = (float)(1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1; // Depends on max #bits in brightness type
-    float level = float(i_level)/maxLevel;
-    if (level < dimmer.minLevel) level = dimmer.minLevel;
-    if (level > 1) level = 1;
-    dimmer.level = level;
-    IFDEBUG IotsaSerial.printf("xxxjack ble: wrote brightness %s value %d %f\n", Lissabon::Dimmer::brightnessUUIDstring, i_level, dimmer.level);
-    anyChanged = true;
-  }
+  } else if (charUUID == Lissabon::Dimmer::brightnessUUIDstring) {
+    command.type = Command::cmd_brightness;
+    command.value = bleApi.getAsInt(Lissabon::Dimmer::brightnessUUIDstring);
 #endif
 #ifdef DIMMER_WITH_TEMPERATURE
-  if (charUUID == Lissabon::Dimmer::temperatureUUIDstring) {
-    int temperature = bleApi.getAsInt(Lissabon::Dimmer::temperatureUUIDstring);
-    dimmer.temperature = temperature;
-    IFDEBUG IotsaSerial.printf("xxxjack ble: wrote temperature %s value %d\n", Lissabon::Dimmer::temperatureUUIDstring, dimmer.temperature);
-    anyChanged = true;
-  }
+  } else if (charUUID == Lissabon::Dimmer::temperatureUUIDstring) {
+    command.type = Command::cmd_temperature;
+    command.value = bleApi.getAsInt(Lissabon::Dimmer::temperatureUUIDstring);
 #endif
-  if (charUUID == Lissabon::Dimmer::isOnUUIDstring) {
-    int value = bleApi.getAsInt(Lissabon::Dimmer::isOnUUIDstring);
-    dimmer.isOn = (bool)value;
-    IFDEBUG IotsaSerial.printf("xxxjack ble: wrote isOn %s value %d\n", Lissabon::Dimmer::isOnUUIDstring, dimmer.isOn);
-    if (!value && auxDimmer != nullptr) {
-      auxDimmer->isOn = false;
-      auxDimmer->updateDimmer();
-      IFDEBUG IotsaSerial.printf("xxxjack ble: also turned off auxdimmer\n");
-    } 
-    anyChanged = true;
+  } else if (charUUID == Lissabon::Dimmer::identifyUUIDstring) {
+    command.type = Command::cmd_identify;
+    command.value = bleApi.getAsInt(Lissabon::Dimmer::identifyUUIDstring);
+  } else {
+    IotsaSerial.printf("IotsaDimmerMod: ble: write unknown uuid %s\n", charUUID);
+    return false;
   }
-  if (charUUID == Lissabon::Dimmer::identifyUUIDstring) {
-    int value = bleApi.getAsInt(Lissabon::Dimmer::identifyUUIDstring);
-    if (value) dimmer.identify();
-    IFDEBUG IotsaSerial.printf("xxxjack ble: identify %s value %d\n", Lissabon::Dimmer::identifyUUIDstring, value);
-    return true;
+  if (!commands.push(command)) {
+    // Refuse it, so the client doesn't take the write as done.
+    IotsaSerial.println("DimmerBLEServer: command ring full, write refused");
+    return false;
   }
-  if (anyChanged) {
-    dimmer.updateDimmer();
-    return true;
+  // Count the change now, before the client gets its response: it may read
+  // the generation straight away, before loop() has applied the command.
+  if (command.type != Command::cmd_identify) dimmer.stateGeneration++;
+  return true;
+}
+
+void DimmerBLEServer::_handleCommands() {
+  Command command;
+  int changes = 0;
+  while (commands.pop(command)) {
+    switch(command.type) {
+    case Command::cmd_isOn:
+      dimmer.isOn = (bool)command.value;
+      IFDEBUG IotsaSerial.printf("xxxjack ble: wrote isOn %s value %d\n", Lissabon::Dimmer::isOnUUIDstring, dimmer.isOn);
+      if (!command.value && auxDimmer != nullptr) {
+        auxDimmer->isOn = false;
+        auxDimmer->updateDimmer();
+        IFDEBUG IotsaSerial.printf("xxxjack ble: also turned off auxdimmer\n");
+      } 
+      changes++;
+      break;
+#ifdef DIMMER_WITH_LEVEL
+    case Command::cmd_brightness:
+      {
+        float maxLevel = (float)(1<<sizeof(Lissabon::Dimmer::Type_brightness)*8)-1; // Depends on max #bits in brightness type
+        float level = float(command.value)/maxLevel;
+        if (level < dimmer.minLevel) level = dimmer.minLevel;
+        if (level > 1) level = 1;
+        dimmer.level = level;
+        IFDEBUG IotsaSerial.printf("xxxjack ble: wrote brightness %s value %d %f\n", Lissabon::Dimmer::brightnessUUIDstring, command.value, dimmer.level);
+        changes++;
+      }
+      break;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+    case Command::cmd_temperature:
+      dimmer.temperature = command.value;
+      IFDEBUG IotsaSerial.printf("xxxjack ble: wrote temperature %s value %d\n", Lissabon::Dimmer::temperatureUUIDstring, command.value);
+      changes++;
+      break;
+#endif
+    case Command::cmd_identify:
+      if (command.value) dimmer.identify();
+      IFDEBUG IotsaSerial.printf("xxxjack ble: identify %s value %d\n", Lissabon::Dimmer::identifyUUIDstring, command.value);
+      break;
+    default:
+      break;
+    }
   }
-  IotsaSerial.printf("IotsaDimmerMod: ble: write unknown uuid %s\n", charUUID);
-  return false;
+  if (changes == 0) return;
+  // One update for the whole batch. Every write was already counted as a
+  // change by blePutHandler(): BLEDimmer's lost-update detection relies on that.
+  dimmer.generationCounted = true;
+  dimmer.updateDimmer();
 }
 
 bool DimmerBLEServer::bleGetHandler(UUIDstring charUUID) {
@@ -114,6 +223,17 @@ bool DimmerBLEServer::bleGetHandler(UUIDstring charUUID) {
       bleApi.set(Lissabon::Dimmer::isOnUUIDstring, (Lissabon::Dimmer::Type_isOn)dimmer.isOn);
       return true;
   }
+  if (charUUID == Lissabon::Dimmer::generationUUIDstring) {
+      IFDEBUG IotsaSerial.printf("DimmerBLEServer: read generation %s value %u\n", Lissabon::Dimmer::generationUUIDstring, dimmer.stateGeneration.load());
+      bleApi.set(Lissabon::Dimmer::generationUUIDstring, (Lissabon::Dimmer::Type_generation)dimmer.stateGeneration);
+      return true;
+  }
+  if (charUUID == Lissabon::Dimmer::layoutUUIDstring) {
+      Lissabon::Dimmer::Type_layout layout = _layoutHash();
+      IFDEBUG IotsaSerial.printf("DimmerBLEServer: read layout %s value 0x%x\n", Lissabon::Dimmer::layoutUUIDstring, layout);
+      bleApi.set(Lissabon::Dimmer::layoutUUIDstring, layout);
+      return true;
+  }
   IotsaSerial.printf("IotsaDimmerMod: ble: read unknown uuid %s\n", charUUID);
   return false;
 }
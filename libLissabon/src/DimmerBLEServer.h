@@ -5,6 +5,8 @@
 #include "iotsaBLEServer.h"
 #include "AbstractDimmer.h"
 #include "LissabonBLE.h"
+#include "DimmerGattCache.h"
+#include "SpscRing.h"
 
 namespace Lissabon {
 
@@ -12,6 +14,8 @@ class DimmerBLEServer : public IotsaBLEApiProvider {
 public:
   DimmerBLEServer(AbstractDimmer& _dimmer) : dimmer(_dimmer), auxDimmer(nullptr) {};
   void setup();
+  void loop();
+  void getHandler(JsonObject& reply);
   void setAuxDimmer(AbstractDimmer* _auxDimmer) { auxDimmer = _auxDimmer; }
 protected:
   AbstractDimmer& dimmer;
@@ -19,6 +23,20 @@ protected:
   IotsaBleApiService bleApi;
   bool blePutHandler(UUIDstring charUUID);
   bool bleGetHandler(UUIDstring charUUID);
+  void _setConnParams(bool interactive);
+  // What a client with cached handles expects to read from the layout characteristic.
+  Lissabon::Dimmer::Type_layout _layoutHash();
+  // Writes from the BLE host task, applied to the dimmer by loop().
+  struct Command {
+    enum Type { cmd_isOn, cmd_brightness, cmd_temperature, cmd_identify } type;
+    int value;
+  };
+  SpscRing<Command, 16> commands;
+  void _handleCommands();
+  // Set from the BLE host task when a write arrives, acted upon in loop().
+  volatile bool wantInteractive = false;
+  volatile uint32_t lastWriteMillis = 0;
+  bool connIsInteractive = false;
 };
 }
 #endif // IOTSA_WITH_BLE
@@ -7,6 +7,7 @@
 //
 
 #include "DimmerCollection.h"
+#include <algorithm>
 
 using namespace Lissabon;
 
@@ -14,8 +15,31 @@ int DimmerCollection::size() {
   return dimmers.size(); 
 }
 
-void DimmerCollection::push_back(DimmerCollection::ItemType* dimmer) { 
+DimmerCollection::Handle DimmerCollection::push_back(DimmerCollection::ItemType* dimmer) { 
+  int i = dimmers.size();
+  Handle handle = nextHandle++;
+  String ident = "dimmer" + String(dimmer->num);
   dimmers.push_back(dimmer);
+  idents.push_back(ident);
+  handles.push_back(handle);
+  byIdent[ident.c_str()] = i;
+  byNum[dimmer->num] = i;
+  byHandle[handle] = i;
+  identitiesIndexed = false;
+  return handle;
+}
+
+void DimmerCollection::_forgetAll() {
+  // Handles are not reused, so old ones stay invalid.
+  dimmers.clear();
+  idents.clear();
+  handles.clear();
+  byIdent.clear();
+  byNum.clear();
+  byHandle.clear();
+  byName.clear();
+  byAddress.clear();
+  identitiesIndexed = false;
 }
 
 DimmerCollection::ItemType* DimmerCollection::at(int i) { 
@@ -23,11 +47,53 @@ DimmerCollection::ItemType* DimmerCollection::at(int i) {
   return dimmers.at(i); 
 }
 
-DimmerCollection::ItemType* DimmerCollection::find(const String& name) { 
-  for(auto d : dimmers) {
-    if (d->getUserVisibleName() == name) return d;
+DimmerCollection::Handle DimmerCollection::handleOf(int i) {
+  if (i<0||i>=handles.size()) return noHandle;
+  return handles.at(i);
+}
+
+DimmerCollection::ItemType* DimmerCollection::get(Handle handle) {
+  auto it = byHandle.find(handle);
+  if (it == byHandle.end()) return nullptr;
+  return dimmers.at(it->second);
+}
+
+DimmerCollection::ItemType* DimmerCollection::findByNum(int num) {
+  auto it = byNum.find(num);
+  if (it == byNum.end()) return nullptr;
+  return dimmers.at(it->second);
+}
+
+void DimmerCollection::_reindexIdentities() {
+  if (identitiesIndexed && indexedIdentityChanges == AbstractDimmer::identityChanges) return;
+  byName.clear();
+  byAddress.clear();
+  for (int i=0; i<dimmers.size(); i++) {
+    // First one wins, as the linear search used to do.
+    byName.emplace(dimmers[i]->getUserVisibleName().c_str(), i);
+    String address = dimmers[i]->getAddress();
+    if (address != "") byAddress.emplace(address.c_str(), i);
   }
-  return nullptr;
+  indexedIdentityChanges = AbstractDimmer::identityChanges;
+  identitiesIndexed = true;
+}
+
+int DimmerCollection::_indexOf(const std::unordered_map<std::string, int>& index, const char *key) {
+  auto it = index.find(key);
+  if (it == index.end()) return -1;
+  return it->second;
+}
+
+DimmerCollection::ItemType* DimmerCollection::find(const String& name) { 
+  _reindexIdentities();
+  int i = _indexOf(byName, name.c_str());
+  return i < 0 ? nullptr : dimmers.at(i);
+}
+
+DimmerCollection::ItemType* DimmerCollection::findByAddress(const String& address) { 
+  _reindexIdentities();
+  int i = _indexOf(byAddress, address.c_str());
+  return i < 0 ? nullptr : dimmers.at(i);
 }
 
 DimmerCollection::iterator DimmerCollection::begin() { return dimmers.begin(); }
@@ -46,42 +112,133 @@ void DimmerCollection::loop() {
   }
 }
 
+int DimmerCollection::applyToGroup(const std::vector<String>& names, const GroupState& state) {
+  // Only the fields the group command sets are sent: a member we never read
+  // from keeps its own level and temperature on an "all off".
+  int fields = 0;
+  if (state.isOn >= 0) fields |= AbstractDimmer::field_isOn;
+#ifdef DIMMER_WITH_LEVEL
+  if (state.level >= 0) fields |= AbstractDimmer::field_level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+  if (state.temperature >= 0) fields |= AbstractDimmer::field_temperature;
+#endif
+  // Nothing to set: not a command.
+  if (fields == 0) return 0;
+  // Resolve and deduplicate
+  std::vector<int> members;
+  if (names.empty()) {
+    for (int i=0; i<dimmers.size(); i++) members.push_back(i);
+  } else {
+    _reindexIdentities();
+    std::vector<bool> seen(dimmers.size(), false);
+    for (auto& name : names) {
+      int i = _indexOf(byName, name.c_str());
+      if (i < 0) {
+        IotsaSerial.printf("DimmerCollection: group: no dimmer %s\n", name.c_str());
+        continue;
+      }
+      if (seen[i]) continue;
+      seen[i] = true;
+      members.push_back(i);
+    }
+  }
+  // Order: commands are queued (and, for BLE dimmers, sent) in this order.
+  std::vector<int> costs(dimmers.size(), 0);
+  for (int i : members) costs[i] = dimmers[i]->commandCost();
+  std::stable_sort(members.begin(), members.end(), [&costs](int a, int b) { return costs[a] < costs[b]; });
+  groupHandles.clear();
+  groupStartMillis = millis();
+  for (int i : members) {
+    ItemType *d = dimmers[i];
+    if (state.isOn >= 0) d->isOn = state.isOn;
+#ifdef DIMMER_WITH_LEVEL
+    if (state.level >= 0) d->level = state.level;
+#endif
+#ifdef DIMMER_WITH_TEMPERATURE
+    if (state.temperature >= 0) d->temperature = state.temperature;
+#endif
+    d->updateDimmerFields(fields);
+    groupHandles.push_back(handles[i]);
+  }
+  IFDEBUG IotsaSerial.printf("DimmerCollection: group command for %d dimmers\n", members.size());
+  return members.size();
+}
+
+bool DimmerCollection::_groupPutHandler(const JsonObject& request) {
+  std::vector<String> names;
+  if (request["dimmers"].is<JsonArray>()) {
+    for (JsonVariant v : request["dimmers"].as<JsonArray>()) {
+      if (v.is<int>()) {
+        ItemType *d = findByNum(v.as<int>());
+        if (d) names.push_back(d->getUserVisibleName());
+      } else {
+        names.push_back(v.as<String>());
+      }
+    }
+    // An explicitly empty list means no dimmers, not all of them.
+    if (names.empty()) return false;
+  }
+  GroupState state;
+  if (request["isOn"].is<bool>() || request["isOn"].is<int>()) state.isOn = request["isOn"].as<int>() ? 1 : 0;
+  state.level = request["level"] | -1.0;
+  state.temperature = request["temperature"] | -1.0;
+  return applyToGroup(names, state) > 0;
+}
+
 void DimmerCollection::getHandler(JsonObject& reply) {
-  for (auto d : dimmers) {
-    String ident = "dimmer" + String(d->num);
-    JsonObject dimmerReply = reply[ident].to<JsonObject>();
-    d->getHandler(dimmerReply);
+  for (int i=0; i<dimmers.size(); i++) {
+    JsonObject dimmerReply = reply[idents[i].c_str()].to<JsonObject>();
+    dimmers[i]->getHandler(dimmerReply);
+  }
+  if (groupStartMillis != 0) {
+    // Per dimmer of the last group command: milliseconds until it took effect, or null if it hasn't yet.
+    JsonObject groupReply = reply["group"].to<JsonObject>();
+    groupReply["age"] = millis() - groupStartMillis;
+    JsonObject completed = groupReply["completed"].to<JsonObject>();
+    for (Handle h : groupHandles) {
+      auto it = byHandle.find(h);
+      if (it == byHandle.end()) continue;
+      ItemType *d = dimmers[it->second];
+      if (d->commandCompletedMillis != 0 && (int32_t)(d->commandCompletedMillis - groupStartMillis) >= 0) {
+        completed[idents[it->second].c_str()] = d->commandCompletedMillis - groupStartMillis;
+      } else {
+        completed[idents[it->second].c_str()] = nullptr;
+      }
+    }
   }
 }
 
 bool DimmerCollection::putHandler(const JsonVariant& request) {
   bool anyChanged = false;
   JsonObject reqObj = request.as<JsonObject>();
-  for (auto d : dimmers) {
-    String ident = "dimmer" + String(d->num);
-    JsonVariant dimmerRequest = reqObj[ident];
-    if (dimmerRequest) {
-      if (d->putHandler(dimmerRequest)) anyChanged = true;
-    }
+  if (reqObj["group"].is<JsonObject>()) {
+    if (_groupPutHandler(reqObj["group"].as<JsonObject>())) anyChanged = true;
+  }
+  // Only look at the dimmers mentioned in the request.
+  for (JsonPair kv : reqObj) {
+    int i = _indexOf(byIdent, kv.key().c_str());
+    if (i < 0) continue;
+    if (dimmers[i]->putHandler(kv.value())) anyChanged = true;
   }
   return anyChanged;
 }
 
 bool DimmerCollection::configLoad(IotsaConfigFileLoad& cf, const String& f_name) {
   bool rv = false;
-  for (auto d : dimmers) {
-    String ident = "dimmer" + String(d->num);
+  for (int i=0; i<dimmers.size(); i++) {
+    String ident = idents[i];
     if (f_name != "") ident = f_name + "." + ident;
-    rv |= d->configLoad(cf, ident);
+    rv |= dimmers[i]->configLoad(cf, ident);
   }
   return rv;
 }
 
 void DimmerCollection::configSave(IotsaConfigFileSave& cf, const String& f_name) {
-  for (auto d : dimmers) {
-    String ident = "dimmer" + String(d->num);
+  for (int i=0; i<dimmers.size(); i++) {
+    String ident = idents[i];
     if (f_name != "") ident = f_name + "." + ident;
-    d->configSave(cf, ident);
+    dimmers[i]->configSave(cf, ident);
   }
 }
 
@@ -7,6 +7,8 @@
 
 #include "AbstractDimmer.h"
 #include "DimmerUI.h"
+#include <unordered_map>
+#include <string>
 
 //#include <ArduinoJson.h>
 //using namespace ArduinoJson;
@@ -17,14 +19,34 @@ public:
   typedef AbstractDimmer ItemType;
   typedef std::vector<ItemType*> ItemVectorType;
   typedef ItemVectorType::iterator iterator;
+  // Refers to a dimmer independent of its position. Unlike an index or a
+  // pointer it never refers to the wrong dimmer: after clear() get() returns nullptr.
+  typedef uint32_t Handle;
+  static const Handle noHandle = 0;
 
   int size();
-  void push_back(ItemType* dimmer);
+  Handle push_back(ItemType* dimmer);
   ItemType* at(int i);
+  // Lookups are through hash indexes, not by scanning the dimmers.
   ItemType* find(const String& name);
+  ItemType* findByNum(int num);
+  ItemType* findByAddress(const String& address);
+  ItemType* get(Handle handle);
+  Handle handleOf(int i);
   iterator begin();
   iterator end();
 
+  // One state for a set of dimmers. Fields that are negative are left alone.
+  struct GroupState {
+    int isOn = -1;
+    float level = -1;
+    float temperature = -1;
+  };
+  // Apply state to the dimmers with the given names (all if names is empty)
+  // as one batch: each dimmer once, cheapest to reach first. Returns the
+  // number of dimmers in the batch.
+  int applyToGroup(const std::vector<String>& names, const GroupState& state);
+
   void getHandler(JsonObject& reply);
   bool putHandler(const JsonVariant& request);
   void setup();
@@ -35,7 +57,28 @@ public:
   void formHandler_fields(String& message, const String& text, const String& f_name, bool includeConfig);
   String info();
 protected:
+  void _forgetAll();
+  int _indexOf(const std::unordered_map<std::string, int>& index, const char *key);
+  void _reindexIdentities();
+  bool _groupPutHandler(const JsonObject& request);
+  // Last batch, for reporting per-dimmer completion in getHandler().
+  std::vector<Handle> groupHandles;
+  uint32_t groupStartMillis = 0;
   ItemVectorType dimmers;
+  // Parallel to dimmers: REST key ("dimmer" + num) and handle of each dimmer.
+  std::vector<String> idents;
+  std::vector<Handle> handles;
+  Handle nextHandle = 1;
+  // From key to position in dimmers.
+  std::unordered_map<std::string, int> byIdent;
+  std::unordered_map<int, int> byNum;
+  std::unordered_map<Handle, int> byHandle;
+  // Names and addresses can change after push_back(), these two are rebuilt
+  // when AbstractDimmer::identityChanges says so.
+  std::unordered_map<std::string, int> byName;
+  std::unordered_map<std::string, int> byAddress;
+  uint32_t indexedIdentityChanges = 0;
+  bool identitiesIndexed = false;
 };
 }
 #endif // _DIMMERCOLLECTION_H_
\ No newline at end of file
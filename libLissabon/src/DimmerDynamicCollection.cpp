@@ -10,17 +10,17 @@
 
 using namespace Lissabon;
 
-void DimmerDynamicCollection::push_back_new(const String& name) {
+DimmerCollection::Handle DimmerDynamicCollection::push_back_new(const String& name) {
   ItemType *item = factory(dimmers.size());
   item->setName(name);
-  push_back(item);
+  return push_back(item);
 }
 
 void DimmerDynamicCollection::clear() {
   for(auto d : dimmers) {
     delete d;
   }
-  dimmers.clear();
+  _forgetAll();
 }
 
 bool DimmerDynamicCollection::configLoad(IotsaConfigFileLoad& cf, const String& f_name) {
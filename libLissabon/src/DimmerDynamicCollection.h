@@ -9,7 +9,7 @@ class DimmerDynamicCollection : public DimmerCollection {
   typedef std::function<ItemType*(int num)> FactoryFunc;
 public:
   void setFactory(FactoryFunc _factory) {factory = _factory; }
-  void push_back_new(const String& name);
+  Handle push_back_new(const String& name);
   void clear();
   bool configLoad(IotsaConfigFileLoad& cf, const String& f_name) override;
   void configSave(IotsaConfigFileSave& cf, const String& f_name) override;
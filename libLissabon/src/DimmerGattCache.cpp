@@ -0,0 +1,286 @@
+#include "DimmerGattCache.h"
+#ifdef IOTSA_WITH_BLE
+#if defined(CONFIG_NIMBLE_CPP_IDF)
+#include "host/ble_hs.h"
+#else
+#include "nimble/nimble/host/include/host/ble_hs.h"
+#endif
+
+#define GATTCACHE_DEBUG if(0)
+
+namespace Lissabon {
+
+static BLEUUID* attrUUIDs[DimmerGattCache::attr_count] = {
+  &Lissabon::Dimmer::isOnUUID,
+  &Lissabon::Dimmer::identifyUUID,
+  &Lissabon::Dimmer::brightnessUUID,
+  &Lissabon::Dimmer::temperatureUUID,
+  &Lissabon::Dimmer::generationUUID,
+};
+
+// Operations waiting for their callback. A callback that finds no entry for
+// its sequence number belongs to an operation that has given up (and whose
+// cache may be gone), and is ignored. Callbacks hold opsLock while they use
+// the cache, so _endOp() can't return while one is busy with it.
+static SemaphoreHandle_t opsLock = nullptr;
+static const int maxOps = 4;
+static struct {
+  uint32_t seq;
+  DimmerGattCache *cache;
+} ops[maxOps];
+static uint32_t lastSeq = 0;
+
+DimmerGattCache::DimmerGattCache() {
+  if (opsLock == nullptr) opsLock = xSemaphoreCreateMutex();
+  opDone = xSemaphoreCreateBinary();
+  invalidate();
+}
+
+DimmerGattCache::~DimmerGattCache() {
+  if (opDone != nullptr) vSemaphoreDelete(opDone);
+}
+
+void DimmerGattCache::invalidate() {
+  isValid = false;
+  layoutChecked = false;
+  address = "";
+  for (int i=0; i<attr_count; i++) handles[i] = 0;
+}
+
+bool DimmerGattCache::matches(const std::string& _address) {
+  return isValid && _address != "" && _address == address;
+}
+
+bool DimmerGattCache::discover(NimBLEClient *client, const std::string& _address) {
+  invalidate();
+  if (client == nullptr || !client->isConnected()) return false;
+  NimBLERemoteService *service = client->getService(Lissabon::Dimmer::serviceUUID);
+  if (service == nullptr) return false;
+  // Without it we couldn't check the handles on the next connection.
+  if (service->getCharacteristic(Lissabon::Dimmer::layoutUUID) == nullptr) return false;
+  for (int i=0; i<attr_count; i++) {
+    // Characteristics we don't find (temperature on a plain dimmer, generation
+    // on older firmware) keep handle 0.
+    NimBLERemoteCharacteristic *characteristic = service->getCharacteristic(*attrUUIDs[i]);
+    if (characteristic) handles[i] = characteristic->getHandle();
+  }
+  if (handles[attr_isOn] == 0) return false;
+  address = _address;
+  isValid = true;
+  // Discovered on this connection, so no need to check them.
+  layoutChecked = true;
+  GATTCACHE_DEBUG IotsaSerial.printf("DimmerGattCache: %s handles %d %d %d %d %d\n", address.c_str(), handles[0], handles[1], handles[2], handles[3], handles[4]);
+  return true;
+}
+
+int DimmerGattCache::_gattCallback(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg) {
+  // Called in the NimBLE host task.
+  xSemaphoreTake(opsLock, portMAX_DELAY);
+  DimmerGattCache *_this = _opCache((uint32_t)(uintptr_t)arg);
+  if (_this != nullptr) {
+    _this->opStatus = error->status;
+    if (error->status == 0 && attr != nullptr && _this->opData != nullptr) {
+      uint16_t len = 0;
+      ble_hs_mbuf_to_flat(attr->om, _this->opData, _this->opSize, &len);
+      if (len != _this->opSize) _this->opStatus = BLE_HS_EBADDATA;
+    }
+    xSemaphoreGive(_this->opDone);
+  }
+  xSemaphoreGive(opsLock);
+  return 0;
+}
+
+int DimmerGattCache::_layoutCallback(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg) {
+  // Called in the NimBLE host task, once per matching attribute and then
+  // once more with BLE_HS_EDONE (or once with an error).
+  xSemaphoreTake(opsLock, portMAX_DELAY);
+  DimmerGattCache *_this = _opCache((uint32_t)(uintptr_t)arg);
+  if (_this != nullptr && error->status == 0 && attr != nullptr) {
+    if (_this->opData != nullptr) {
+      uint16_t len = 0;
+      ble_hs_mbuf_to_flat(attr->om, _this->opData, _this->opSize, &len);
+      _this->opStatus = len == _this->opSize ? 0 : BLE_HS_EBADDATA;
+    }
+  } else if (_this != nullptr) {
+    if (error->status != BLE_HS_EDONE) _this->opStatus = error->status;
+    xSemaphoreGive(_this->opDone);
+  }
+  xSemaphoreGive(opsLock);
+  return 0;
+}
+
+int DimmerGattCache::_checkLayout(NimBLEClient *client) {
+  if (layoutChecked) return 0;
+  Lissabon::Dimmer::Type_layout layout = 0;
+  // Stays BLE_HS_ENOENT if the dimmer has no layout characteristic.
+  uint32_t seq = _beginOp((uint8_t *)&layout, sizeof(layout), BLE_HS_ENOENT);
+  if (seq == 0) return BLE_HS_ENOMEM;
+  int rv = ble_gattc_read_by_uuid(client->getConnHandle(), 1, 0xffff, &Lissabon::Dimmer::layoutUUID.getBase()->u, _layoutCallback, (void *)(uintptr_t)seq);
+  if (rv == 0) rv = _wait();
+  _endOp(seq);
+  if (rv == 0 && layout != layoutHash(handles)) {
+    GATTCACHE_DEBUG IotsaSerial.printf("DimmerGattCache: %s layout 0x%x, expected 0x%x\n", address.c_str(), layout, layoutHash(handles));
+    rv = BLE_HS_ENOENT;
+  }
+  if (rv == 0) {
+    layoutChecked = true;
+  } else if (isStaleHandleError(rv)) {
+    // Dimmer firmware changed: our callers fall back to discovery.
+    invalidate();
+  }
+  return rv;
+}
+
+uint32_t DimmerGattCache::_beginOp(uint8_t *data, size_t size, int status) {
+  uint32_t seq = 0;
+  xSemaphoreTake(opsLock, portMAX_DELAY);
+  for (auto& op : ops) {
+    if (op.seq != 0) continue;
+    if (++lastSeq == 0) lastSeq = 1;
+    seq = op.seq = lastSeq;
+    op.cache = this;
+    break;
+  }
+  if (seq != 0) {
+    // A give from an earlier operation that got in just before its _endOp().
+    xSemaphoreTake(opDone, 0);
+    opStatus = status;
+    opData = data;
+    opSize = size;
+  }
+  xSemaphoreGive(opsLock);
+  return seq;
+}
+
+void DimmerGattCache::_endOp(uint32_t seq) {
+  xSemaphoreTake(opsLock, portMAX_DELAY);
+  for (auto& op : ops) {
+    if (op.seq == seq) op.seq = 0;
+  }
+  opData = nullptr;
+  opSize = 0;
+  xSemaphoreGive(opsLock);
+}
+
+DimmerGattCache *DimmerGattCache::_opCache(uint32_t seq) {
+  // With opsLock held.
+  if (seq == 0) return nullptr;
+  for (auto& op : ops) {
+    if (op.seq == seq) return op.cache;
+  }
+  return nullptr;
+}
+
+int DimmerGattCache::_wait() {
+  if (xSemaphoreTake(opDone, pdMS_TO_TICKS(opTimeoutMillis)) != pdTRUE) {
+    return BLE_HS_ETIMEOUT;
+  }
+  return opStatus;
+}
+
+int DimmerGattCache::write(NimBLEClient *client, Attr attr, const uint8_t *data, size_t size, bool response) {
+  if (!isValid) return BLE_HS_ENOENT;
+  if (handles[attr] == 0) return BLE_HS_ENOTSUP;
+  if (client == nullptr || !client->isConnected()) return BLE_HS_ENOTCONN;
+  int rv = _checkLayout(client);
+  if (rv != 0) return rv;
+  uint16_t connHandle = client->getConnHandle();
+  if (!response) {
+    return ble_gattc_write_no_rsp_flat(connHandle, handles[attr], data, size);
+  }
+  uint32_t seq = _beginOp(nullptr, 0, 0);
+  if (seq == 0) return BLE_HS_ENOMEM;
+  rv = ble_gattc_write_flat(connHandle, handles[attr], data, size, _gattCallback, (void *)(uintptr_t)seq);
+  if (rv == 0) rv = _wait();
+  _endOp(seq);
+  return rv;
+}
+
+int DimmerGattCache::read(NimBLEClient *client, Attr attr, uint8_t *data, size_t size) {
+  if (!isValid) return BLE_HS_ENOENT;
+  if (handles[attr] == 0) return BLE_HS_ENOTSUP;
+  if (client == nullptr || !client->isConnected()) return BLE_HS_ENOTCONN;
+  int rv = _checkLayout(client);
+  if (rv != 0) return rv;
+  uint32_t seq = _beginOp(data, size, 0);
+  if (seq == 0) return BLE_HS_ENOMEM;
+  rv = ble_gattc_read(client->getConnHandle(), handles[attr], _gattCallback, (void *)(uintptr_t)seq);
+  if (rv == 0) rv = _wait();
+  _endOp(seq);
+  return rv;
+}
+
+bool DimmerGattCache::isStaleHandleError(int rv) {
+  // ATT-level errors (invalid handle, not permitted, wrong size) mean the peer
+  // doesn't have the characteristic we think it has at this handle.
+  // Timeouts and disconnects say nothing about the handles.
+  return rv == BLE_HS_ENOENT || rv == BLE_HS_EBADDATA || (rv > BLE_HS_ERR_ATT_BASE && rv < BLE_HS_ERR_ATT_BASE + 0x100);
+}
+
+uint32_t DimmerGattCache::layoutHash(const uint16_t *_handles) {
+  // FNV-1a over gattGeneration and the handles, in Attr order.
+  uint32_t hash = 2166136261u;
+  auto add = [&hash](uint16_t value) {
+    hash = (hash ^ (value & 0xff)) * 16777619u;
+    hash = (hash ^ (value >> 8)) * 16777619u;
+  };
+  add(Lissabon::Dimmer::gattGeneration);
+  for (int i=0; i<attr_count; i++) add(_handles[i]);
+  return hash;
+}
+
+BLEUUID& DimmerGattCache::attrUUID(Attr attr) {
+  return *attrUUIDs[attr];
+}
+
+void DimmerGattCache::getHandles(uint16_t *_handles) {
+  for (int i=0; i<attr_count; i++) _handles[i] = handles[i];
+}
+
+bool DimmerGattCache::setHandles(const std::string& _address, const uint16_t *_handles) {
+  invalidate();
+  if (_address == "" || _handles[attr_isOn] == 0) return false;
+  for (int i=0; i<attr_count; i++) handles[i] = _handles[i];
+  address = _address;
+  isValid = true;
+  return true;
+}
+
+void DimmerGattCache::configLoad(IotsaConfigFileLoad& cf, const String& n_name, const String& _address) {
+  invalidate();
+  int generation;
+  String value;
+  cf.get(n_name + ".handlesGeneration", generation, 0);
+  cf.get(n_name + ".handles", value, "");
+  if (generation != Lissabon::Dimmer::gattGeneration || value == "" || _address == "") return;
+  // Comma-separated list of handles, in Attr order.
+  int start = 0;
+  for (int i=0; i<attr_count; i++) {
+    int end = value.indexOf(',', start);
+    if (end < 0) end = value.length();
+    handles[i] = value.substring(start, end).toInt();
+    start = end+1;
+  }
+  if (handles[attr_isOn] == 0) return;
+  address = _address.c_str();
+  isValid = true;
+}
+
+void DimmerGattCache::configSave(IotsaConfigFileSave& cf, const String& n_name) {
+  if (!isValid) return;
+  String value;
+  for (int i=0; i<attr_count; i++) {
+    if (i) value += ",";
+    value += String(handles[i]);
+  }
+  cf.put(n_name + ".handles", value);
+  cf.put(n_name + ".handlesGeneration", (int)Lissabon::Dimmer::gattGeneration);
+}
+
+String DimmerGattCache::info() {
+  if (!isValid) return "GATT handles not cached";
+  return "GATT handles cached for " + String(address.c_str());
+}
+
+}
+#endif // IOTSA_WITH_BLE
@@ -0,0 +1,84 @@
+#ifndef _DIMMERGATTCACHE_H_
+#define _DIMMERGATTCACHE_H_
+//
+// Cache of GATT attribute handles of a remote dimmer, so a new connection
+// can read and write characteristics by handle straight away, without first
+// doing service and characteristic discovery.
+//
+// The handles are checked once per connection, before the first read or
+// write, against the layout characteristic of the dimmer. That one is read
+// by UUID, so it costs one round trip and no discovery. A dimmer that doesn't
+// have it (older firmware) isn't cached.
+//
+#include "iotsa.h"
+#ifdef IOTSA_WITH_BLE
+#include "iotsaConfigFile.h"
+#include <NimBLEDevice.h>
+#include "LissabonBLE.h"
+
+namespace Lissabon {
+
+class DimmerGattCache {
+public:
+  enum Attr {
+    attr_isOn,
+    attr_identify,
+    attr_brightness,
+    attr_temperature,
+    attr_generation,
+    attr_count
+  };
+  DimmerGattCache();
+  ~DimmerGattCache();
+  // True if we have handles for this device address.
+  bool matches(const std::string& address);
+  bool valid() { return isValid; }
+  // False if the handles are cached but the peer doesn't have this characteristic.
+  bool has(Attr attr) { return !isValid || handles[attr] != 0; }
+  void invalidate();
+  // Call after (re)connecting: the handles are checked again before they are used.
+  void newConnection() { layoutChecked = false; }
+  // Get handles from the (already discovered) service on an open connection.
+  bool discover(NimBLEClient *client, const std::string& address);
+  // Read/write by handle. Return 0 on success, otherwise a NimBLE host error code
+  // (BLE_HS_ENOTSUP if the peer doesn't have the characteristic).
+  int write(NimBLEClient *client, Attr attr, const uint8_t *data, size_t size, bool response=true);
+  int read(NimBLEClient *client, Attr attr, uint8_t *data, size_t size);
+  // True if an error returned by read() or write() means the handles are stale.
+  static bool isStaleHandleError(int rv);
+  // Layout hash as exposed by the dimmer in the layout characteristic.
+  static uint32_t layoutHash(const uint16_t *_handles);
+  static BLEUUID& attrUUID(Attr attr);
+  // For keeping the handles somewhere else (RTC memory over a deep sleep).
+  void getHandles(uint16_t *_handles);
+  bool setHandles(const std::string& _address, const uint16_t *_handles);
+  void configLoad(IotsaConfigFileLoad& cf, const String& n_name, const String& address);
+  void configSave(IotsaConfigFileSave& cf, const String& n_name);
+  String info();
+protected:
+  static int _gattCallback(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg);
+  static int _layoutCallback(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg);
+  int _wait();
+  int _checkLayout(NimBLEClient *client);
+  // Every read or write is tagged with a sequence number, passed to the
+  // callback as its argument, so a late callback of an operation that timed
+  // out can't complete the next one. Returns 0 if too many are in progress.
+  uint32_t _beginOp(uint8_t *data, size_t size, int status);
+  void _endOp(uint32_t seq);
+  static DimmerGattCache *_opCache(uint32_t seq);
+  bool isValid = false;
+  bool layoutChecked = false;
+  std::string address;
+  uint16_t handles[attr_count];
+  // State of the in-progress read or write (only one at a time per cache).
+  // Only touched by a callback while it holds opsLock and the op is current.
+  SemaphoreHandle_t opDone;
+  int opStatus = 0;
+  uint8_t *opData = nullptr;
+  size_t opSize = 0;
+  // How long we wait for the peer to respond to a read or write.
+  const uint32_t opTimeoutMillis = 2000;
+};
+};
+#endif // IOTSA_WITH_BLE
+#endif // _DIMMERGATTCACHE_H_
@@ -23,7 +23,7 @@ DimmerUI::levelChanged() {
   IFDEBUG IotsaSerial.printf(" temperature=%f", dimmer.temperature);
 #endif
   IFDEBUG IotsaSerial.println();
-  dimmer.updateDimmer();
+  dimmer.updateDimmerStreaming();
 #endif // DIMMER_WITH_LEVEL
   return true;
 }
@@ -68,7 +68,22 @@ DimmerUI::setOnOffButton(Button& button) {
   button.bindVar(dimmer.isOn, true);
 }
 
+bool
+DimmerUI::tapUpDown(bool up) {
+  dimmer.isOn = up;
+  return touchedOnOff();
+}
+
 #ifdef DIMMER_WITH_TEMPERATURE
+bool
+DimmerUI::tapTemperatureUpDown(bool up) {
+  float temperature = dimmer.temperature + (up ? 100 : -100);
+  if (temperature < DIMMER_MIN_TEMPERATURE) temperature = DIMMER_MIN_TEMPERATURE;
+  if (temperature > DIMMER_MAX_TEMPERATURE) temperature = DIMMER_MAX_TEMPERATURE;
+  dimmer.temperature = temperature;
+  return levelChanged();
+}
+
 void
 DimmerUI::setTemperatureUpDownButtons(UpDownButtons& encoder) {
   encoder.setCallback(std::bind(&DimmerUI::levelChanged, this));
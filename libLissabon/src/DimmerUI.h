@@ -17,6 +17,12 @@ public:
 #ifdef DIMMER_WITH_TEMPERATURE
   void setTemperatureUpDownButtons(UpDownButtons& encoder);
   void setTemperatureRotaryEncoder(RotaryEncoder& encoder);
+#endif
+  // A short tap on an up/down pad that was over before the input module saw it
+  // (after a touch wakeup): same as a short press, on or off.
+  bool tapUpDown(bool up);
+#ifdef DIMMER_WITH_TEMPERATURE
+  bool tapTemperatureUpDown(bool up);
 #endif
 protected:
   bool touchedOnOff();
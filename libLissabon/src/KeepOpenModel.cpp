@@ -0,0 +1,72 @@
+#include "KeepOpenModel.h"
+
+namespace Lissabon {
+
+const uint32_t KeepOpenModel::bucketEdges[KeepOpenModel::nEdges] = {
+  500, 1000, 2000, 3000, 5000, 8000, 12000, 20000, 30000, 60000
+};
+
+void KeepOpenModel::command(uint32_t now, bool connectionOpen, uint32_t maxMillis) {
+  uint32_t gap = now - lastCommandMillis;
+  bool first = lastCommandMillis == 0;
+  lastCommandMillis = now ? now : 1;
+  if (!first && gap < coalesceMillis) return;
+  if (connectionOpen) hits++; else misses++;
+  if (first) return;
+  int bucket = 0;
+  while (bucket < nEdges && gap >= bucketEdges[bucket]) bucket++;
+  counts[bucket]++;
+  samples++;
+  if (samples >= decaySamples) {
+    samples = 0;
+    for (int i=0; i<=nEdges; i++) {
+      counts[i] /= 2;
+      samples += counts[i];
+    }
+  }
+  _choose(maxMillis);
+}
+
+void KeepOpenModel::_choose(uint32_t maxMillis) {
+  adaptive = samples >= minSamples;
+  if (!adaptive) {
+    chosenMillis = fallbackMillis;
+    return;
+  }
+  // Expected cost (times samples) of each candidate window: a gap that fits
+  // costs its length in connected time, one that doesn't costs the whole
+  // window plus a reconnect. Gaps are taken at the middle of their bucket.
+  // Window 0 (disconnect straight away) is a candidate too.
+  uint32_t bestWindow = 0;
+  uint64_t bestCost = UINT64_MAX;
+  for (int w=-1; w<nEdges; w++) {
+    uint32_t window = w < 0 ? 0 : bucketEdges[w];
+    if (window > maxMillis) break;
+    uint64_t cost = 0;
+    for (int b=0; b<=nEdges; b++) {
+      if (counts[b] == 0) continue;
+      if (b <= w) {
+        uint32_t lower = b == 0 ? 0 : bucketEdges[b-1];
+        cost += (uint64_t)counts[b] * ((lower + bucketEdges[b]) / 2);
+      } else {
+        cost += (uint64_t)counts[b] * (window + reconnectCostMillis);
+      }
+    }
+    if (cost < bestCost) {
+      bestCost = cost;
+      bestWindow = window;
+    }
+  }
+  chosenMillis = bestWindow;
+}
+
+void KeepOpenModel::getHandler(JsonObject& reply) {
+  reply["window"] = keepOpenMillis();
+  reply["adaptive"] = adaptive;
+  reply["samples"] = samples;
+  reply["hits"] = hits;
+  reply["misses"] = misses;
+  if (hits + misses > 0) reply["hitRate"] = (float)hits / (hits + misses);
+}
+
+};
@@ -0,0 +1,50 @@
+#ifndef _KEEPOPENMODEL_H_
+#define _KEEPOPENMODEL_H_
+//
+// Chooses how long to keep a BLE connection open after a command, from the
+// gaps between earlier commands to the same dimmer. Staying connected costs
+// energy for as long as we wait, a reconnect costs energy and makes the user
+// wait. We keep a histogram of the gaps and pick the window with the lowest
+// expected cost, or the fixed fallback window if we haven't seen enough
+// commands yet.
+//
+#include "iotsa.h"
+#include <atomic>
+
+namespace Lissabon {
+
+class KeepOpenModel {
+public:
+  KeepOpenModel(uint32_t _fallbackMillis) : fallbackMillis(_fallbackMillis), chosenMillis(_fallbackMillis) {}
+  // A command was given. connectionOpen tells whether it found the connection
+  // still open. maxMillis caps the window. Main task only.
+  void command(uint32_t now, bool connectionOpen, uint32_t maxMillis);
+  // The current choice, may be called from any task.
+  uint32_t keepOpenMillis() { return chosenMillis; }
+  void getHandler(JsonObject& reply);
+  uint32_t fallbackMillis;
+protected:
+  void _choose(uint32_t maxMillis);
+  // Upper edges of the histogram buckets. There is one more bucket for
+  // longer gaps, which no window we would choose can bridge.
+  static const int nEdges = 10;
+  static const uint32_t bucketEdges[nEdges];
+  uint16_t counts[nEdges+1] = {};
+  uint32_t samples = 0;
+  uint32_t lastCommandMillis = 0;
+  // Commands closer together than this (a slider drag) count as one.
+  const uint32_t coalesceMillis = 400;
+  // Below this many gaps we use fallbackMillis.
+  const uint32_t minSamples = 8;
+  // When the histogram holds this many gaps all counts are halved, so it follows changing habits.
+  const uint32_t decaySamples = 64;
+  // Cost of a reconnect (radio time for scan, connect and maybe discovery,
+  // and the user waiting) expressed as milliseconds of idle connection.
+  const uint32_t reconnectCostMillis = 4000;
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+  bool adaptive = false;
+  std::atomic<uint32_t> chosenMillis;
+};
+};
+#endif // _KEEPOPENMODEL_H_
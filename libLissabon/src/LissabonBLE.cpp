@@ -6,6 +6,7 @@ namespace Dimmer {
 // UUID of service advertised by iotsaLedstrip and iotsaDimmer devices
 const char* serviceUUIDstring = "6B2F0001-38BC-4204-A506-1D3546AD3688";
 BLEUUID serviceUUID(serviceUUIDstring);
+const uint16_t gattGeneration = 2;
 //const char* serviceUUID2901 = "Lissabon Dimmer Service";
 //const uint8_t serviceUUID2904format = ;
 //const uint16_t serviceUUID2904unit = ;
@@ -34,6 +35,29 @@ const char* temperatureUUID2901 = "Color Temperature";
 const uint8_t temperatureUUID2904format = BLE2904::FORMAT_UINT16;
 const uint16_t temperatureUUID2904unit = 0x2700;
 
+const char* generationUUIDstring = "6B2F0006-38BC-4204-A506-1D3546AD3688";
+BLEUUID generationUUID(generationUUIDstring);
+const char* generationUUID2901 = "State generation";
+const uint8_t generationUUID2904format = BLE2904::FORMAT_UINT32;
+const uint16_t generationUUID2904unit = 0x2700;
+
+const char* layoutUUIDstring = "6B2F0007-38BC-4204-A506-1D3546AD3688";
+BLEUUID layoutUUID(layoutUUIDstring);
+const char* layoutUUID2901 = "GATT layout";
+const uint8_t layoutUUID2904format = BLE2904::FORMAT_UINT32;
+const uint16_t layoutUUID2904unit = 0x2700;
+
+// 7.5-15ms interval, 4s supervision timeout.
+const ConnParams connParamsInteractive = { 6, 12, 0, 400 };
+// 150-200ms interval, up to 4 events skipped by the peripheral (so it may
+// sleep for a second), 6s supervision timeout (must exceed (1+latency)*interval*2).
+const ConnParams connParamsIdle = { 120, 160, 4, 600 };
+const uint32_t connIdleAfterMillis = 500;
+// The fleet sleeps 1500ms (see doc/ble-power.md), UsageSchedule up to this.
+const uint32_t maxSleepMillis = 2500;
+// Plus the wake window and connection setup.
+const uint32_t directConnectTimeoutMillis = 3000;
+
 };
 };
 #endif // IOTSA_WITH_BLE
\ No newline at end of file
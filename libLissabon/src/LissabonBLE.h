@@ -7,6 +7,10 @@ namespace Lissabon {
 namespace Dimmer {
 // UUID of service advertised by iotsaLedstrip and iotsaDimmer devices
 extern BLEUUID serviceUUID;
+// Generation of the dimmer characteristics. Part of the layout hash (see
+// layoutUUID), so increment it when the meaning or format of a characteristic
+// changes: clients that cached the handles then rediscover them.
+extern const uint16_t gattGeneration;
 extern const char* serviceUUIDstring;
 //extern const char* serviceUUID2901;
 //extern const uint8_t serviceUUID2904format;
@@ -40,6 +44,48 @@ extern const uint8_t temperatureUUID2904format;
 extern const uint16_t temperatureUUID2904unit;
 typedef uint16_t Type_temperature;
 
+// Incremented by the dimmer on every state change (local, REST or BLE), so
+// a client can check whether anything changed by reading only this.
+extern BLEUUID generationUUID;
+extern const char* generationUUIDstring;
+extern const char* generationUUID2901;
+extern const uint8_t generationUUID2904format;
+extern const uint16_t generationUUID2904unit;
+typedef uint32_t Type_generation;
+
+// Hash of gattGeneration and the handles of the characteristics above (see
+// DimmerGattCache::layoutHash()). A client with cached handles reads it by
+// UUID, without discovery, to check the handles are still those of the dimmer.
+extern BLEUUID layoutUUID;
+extern const char* layoutUUIDstring;
+extern const char* layoutUUID2901;
+extern const uint8_t layoutUUID2904format;
+extern const uint16_t layoutUUID2904unit;
+typedef uint32_t Type_layout;
+
+// BLE connection parameters requested by both ends of a dimmer connection.
+// Intervals are in units of 1.25ms, supervision timeout in units of 10ms.
+struct ConnParams {
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  uint16_t latency;
+  uint16_t timeout;
+};
+// Used while commands are flowing: short interval, no peripheral latency.
+extern const ConnParams connParamsInteractive;
+// Used while a connection is kept open but idle: long interval, and the
+// peripheral may skip connection events, so both radios mostly sleep.
+extern const ConnParams connParamsIdle;
+// How long without commands before a connection switches to connParamsIdle.
+extern const uint32_t connIdleAfterMillis;
+// Longest light sleep a dimmer may use between advertisements, and how long
+// a client waits for a direct (scanless) connect to a known dimmer before it
+// gives up. A sleeping dimmer only accepts the connection when it next wakes,
+// so the timeout must stay above the sleep. UsageSchedule keeps below the
+// former, BLEDimmer and DeepSleepRemote use the latter.
+extern const uint32_t maxSleepMillis;
+extern const uint32_t directConnectTimeoutMillis;
+
 };
 };
 #endif // IOTSA_WITH_BLE
@@ -0,0 +1,48 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+//
+// Hand a small struct from one task to others without a mutex. There is a
+// single writer, which never waits. Readers copy the data and retry if a
+// write happened while they were copying, so they never see half of one
+// value and half of another.
+//
+// The writer must not run at a lower priority than the readers on the same
+// core: a reader would spin while the writer is preempted mid-write.
+//
+#include <atomic>
+#include <stdint.h>
+#include <type_traits>
+
+namespace Lissabon {
+
+template<typename T> class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock needs a trivially copyable type");
+public:
+  Seqlock() : seq(0), data() {}
+  // Only ever call this from one task.
+  void write(const T& value) {
+    uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    data = value;
+    seq.store(s+2, std::memory_order_release);
+  }
+  T read() const {
+    T rv;
+    uint32_t before, after;
+    do {
+      before = seq.load(std::memory_order_acquire);
+      rv = data;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return rv;
+  }
+  // Number of completed writes, so a reader can cheaply check for news.
+  uint32_t version() const { return seq.load(std::memory_order_acquire) >> 1; }
+protected:
+  std::atomic<uint32_t> seq;
+  T data;
+};
+};
+#endif // _SEQLOCK_H_
@@ -0,0 +1,52 @@
+#ifndef _SPSCRING_H_
+#define _SPSCRING_H_
+//
+// Bounded ring buffer for passing items from exactly one producer task to
+// exactly one consumer task, without locks. push() and pop() never block.
+//
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Lissabon {
+
+template<typename T, size_t N> class SpscRing {
+  static_assert(N > 0 && (N & (N-1)) == 0, "SpscRing size must be a power of two");
+public:
+  // Producer only. Returns false (and counts an overflow) if the ring is full.
+  bool push(const T& item) {
+    size_t head = _head.load(std::memory_order_relaxed);
+    size_t tail = _tail.load(std::memory_order_acquire);
+    if (head - tail == N) {
+      _overflows.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    buffer[head & (N-1)] = item;
+    _head.store(head+1, std::memory_order_release);
+    uint32_t used = head + 1 - tail;
+    if (used > _highWater.load(std::memory_order_relaxed)) _highWater.store(used, std::memory_order_relaxed);
+    return true;
+  }
+  // Consumer only. Returns false if the ring is empty.
+  bool pop(T& item) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t head = _head.load(std::memory_order_acquire);
+    if (tail == head) return false;
+    item = buffer[tail & (N-1)];
+    _tail.store(tail+1, std::memory_order_release);
+    return true;
+  }
+  // Statistics, may be called from any task.
+  size_t size() const { return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire); }
+  size_t capacity() const { return N; }
+  uint32_t highWater() const { return _highWater.load(std::memory_order_relaxed); }
+  uint32_t overflows() const { return _overflows.load(std::memory_order_relaxed); }
+protected:
+  T buffer[N];
+  std::atomic<size_t> _head{0};
+  std::atomic<size_t> _tail{0};
+  std::atomic<uint32_t> _highWater{0};
+  std::atomic<uint32_t> _overflows{0};
+};
+};
+#endif // _SPSCRING_H_
@@ -0,0 +1,64 @@
+#include "TouchWake.h"
+#include <esp_sleep.h>
+
+namespace Lissabon {
+
+// Cleared on power-up, kept over deep sleep.
+static RTC_DATA_ATTR uint16_t rtcUntouched[TouchWake::maxRtcPads];
+
+void TouchWake::addPad(int pin, TapCallback tapped) {
+  int index = pads.size();
+  uint16_t untouched = index < maxRtcPads ? rtcUntouched[index] : 0;
+  Pad pad = { pin, untouched, (uint16_t)(untouched * thresholdPercent / 100), tapped };
+  pads.push_back(pad);
+}
+
+void TouchWake::_calibrate(int index) {
+  Pad& pad = pads[index];
+  uint16_t reading = touchRead(pad.pin);
+  // Touched: keep what we had.
+  if (pad.untouched != 0 && reading < pad.threshold) return;
+  if (reading == pad.untouched) return;
+  IFDEBUG IotsaSerial.printf("TouchWake: pin %d untouched %d threshold %d\n", pad.pin, reading, reading * thresholdPercent / 100);
+  pad.untouched = reading;
+  pad.threshold = reading * thresholdPercent / 100;
+  if (index < maxRtcPads) rtcUntouched[index] = reading;
+}
+
+void TouchWake::sleep() {
+  if (pads.empty()) return;
+  for (int i=0; i<pads.size(); i++) {
+    _calibrate(i);
+    touchSleepWakeUpEnable(pads[i].pin, pads[i].threshold);
+  }
+  esp_sleep_enable_touchpad_wakeup();
+}
+
+void TouchWake::waitForRelease(uint32_t timeoutMillis) {
+  uint32_t giveUpMillis = millis() + timeoutMillis;
+  for (auto& pad : pads) {
+    while (_touched(pad) && millis() < giveUpMillis) delay(10);
+  }
+}
+
+void TouchWake::wakeup() {
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TOUCHPAD) return;
+  int channel = esp_sleep_get_touchpad_wakeup_status();
+  for (auto& pad : pads) {
+    if (digitalPinToTouchChannel(pad.pin) != channel) continue;
+    touchWakeups++;
+    // Still touched: the input module will see the press and release itself.
+    if (_touched(pad)) return;
+    IFDEBUG IotsaSerial.printf("TouchWake: tap on pin %d was over before we woke up\n", pad.pin);
+    injectedTaps++;
+    if (pad.tapped) pad.tapped();
+    return;
+  }
+}
+
+void TouchWake::getHandler(JsonObject& reply) {
+  reply["touchWakeups"] = touchWakeups;
+  reply["injectedTaps"] = injectedTaps;
+}
+
+};
@@ -0,0 +1,53 @@
+#ifndef _TOUCHWAKE_H_
+#define _TOUCHWAKE_H_
+//
+// Lets the ESP32 touch sensor watch the touchpads while we are in light
+// sleep, so we can sleep longer without missing presses. The sensor runs by
+// itself and wakes us when a pad is touched. A short tap may be over before
+// the input module gets to poll the pad after the wakeup: then the tap is
+// handed to the pad's callback in stead, so it isn't lost.
+//
+// Pads are calibrated when we go to sleep, not when they are added: after a
+// deep sleep wakeup the finger that woke us is usually still on the pad. A
+// reading above the threshold is taken as the new untouched value, so a
+// calibration done with a finger on the pad is corrected on the next sleep.
+// The untouched values are kept in RTC memory, so they survive a deep sleep.
+//
+#include "iotsa.h"
+#include <functional>
+#include <vector>
+
+namespace Lissabon {
+
+class TouchWake {
+public:
+  typedef std::function<void()> TapCallback;
+  // Doesn't read the pad, so it can be called before setup().
+  void addPad(int pin, TapCallback tapped);
+  // Call just before going to sleep.
+  void sleep();
+  // Wait until no pad is touched, or timeoutMillis passed. Before a deep
+  // sleep, otherwise the touch that woke us wakes us again straight away.
+  void waitForRelease(uint32_t timeoutMillis);
+  // Call after waking up.
+  void wakeup();
+  void getHandler(JsonObject& reply);
+  // A reading below this percentage of the untouched reading is a touch.
+  int thresholdPercent = 66;
+  // Pads beyond this many are recalibrated after a deep sleep.
+  static const int maxRtcPads = 8;
+protected:
+  struct Pad {
+    int pin;
+    uint16_t untouched;
+    uint16_t threshold;
+    TapCallback tapped;
+  };
+  void _calibrate(int index);
+  bool _touched(const Pad& pad) { return pad.threshold != 0 && touchRead(pad.pin) < pad.threshold; }
+  std::vector<Pad> pads;
+  uint32_t touchWakeups = 0;
+  uint32_t injectedTaps = 0;
+};
+};
+#endif // _TOUCHWAKE_H_
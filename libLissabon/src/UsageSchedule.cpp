@@ -0,0 +1,167 @@
+#include "UsageSchedule.h"
+#include <time.h>
+
+namespace Lissabon {
+
+void UsageSchedule::loop() {
+  // The updateDimmer() from setup isn't a command.
+  if (!started) {
+    started = true;
+    lastGeneration = dimmer.stateGeneration;
+    return;
+  }
+  if (dimmer.stateGeneration == lastGeneration) return;
+  lastGeneration = dimmer.stateGeneration;
+  uint32_t now = millis();
+  bool first = lastCommandMillis == 0;
+  uint32_t gap = now - lastCommandMillis;
+  lastCommandMillis = now ? now : 1;
+  if (!first && gap < coalesceMillis) return;
+  int hour = _currentHour();
+  counts[hour]++;
+  samples++;
+  IFDEBUG IotsaSerial.printf("UsageSchedule: command in hour %d, count %d\n", hour, counts[hour]);
+  if (samples >= decaySamples) {
+    samples = 0;
+    for (int i=0; i<24; i++) {
+      counts[i] /= 2;
+      samples += counts[i];
+    }
+  }
+}
+
+int UsageSchedule::_currentHour() {
+  return (time(nullptr) / 3600) % 24;
+}
+
+bool UsageSchedule::_unoccupied() {
+  return lastCommandMillis != 0 && millis() - lastCommandMillis > unoccupiedMillis;
+}
+
+bool UsageSchedule::_adaptive() {
+  if (baseSleepMillis == 0 || samples < minSamples) return false;
+  // Adapting would move it the wrong way in some hours.
+  return baseSleepMillis >= minSleepMillis && baseSleepMillis <= maxSleepMillis;
+}
+
+void UsageSchedule::_clampBounds() {
+  if (maxSleepMillis > Lissabon::Dimmer::maxSleepMillis) maxSleepMillis = Lissabon::Dimmer::maxSleepMillis;
+  if (minSleepMillis > maxSleepMillis) minSleepMillis = maxSleepMillis;
+}
+
+uint32_t UsageSchedule::sleepMillisForHour(int hour) {
+  if (!_adaptive()) return baseSleepMillis;
+  if (_unoccupied()) return maxSleepMillis;
+  // Commands near the hour boundary belong to both hours, so count the neighbours for half.
+  float weight = counts[hour] + (counts[(hour+23)%24] + counts[(hour+1)%24]) / 2.0;
+  float ratio = weight / (2.0 * samples / 24);
+  float sleepMillis;
+  if (ratio >= 1) {
+    sleepMillis = baseSleepMillis / ratio;
+  } else {
+    sleepMillis = baseSleepMillis;
+    if (maxSleepMillis > baseSleepMillis) sleepMillis += (maxSleepMillis - baseSleepMillis) * (1 - ratio);
+  }
+  if (sleepMillis < minSleepMillis) sleepMillis = minSleepMillis;
+  if (sleepMillis > maxSleepMillis) sleepMillis = maxSleepMillis;
+  return sleepMillis;
+}
+
+float UsageSchedule::_milliAmps(uint32_t sleepMillis) {
+  if (sleepMillis + wakeMillis == 0) return awakeMilliAmps;
+  return (wakeMillis * awakeMilliAmps + sleepMillis * sleepMilliAmps) / (wakeMillis + sleepMillis);
+}
+
+void UsageSchedule::getHandler(JsonObject& reply) {
+  reply["adaptive"] = _adaptive();
+  reply["unoccupied"] = _unoccupied();
+  reply["clockSet"] = time(nullptr) > 1600000000;
+  reply["hour"] = _currentHour();
+  reply["samples"] = samples;
+  reply["minSleep"] = minSleepMillis;
+  reply["maxSleep"] = maxSleepMillis;
+  reply["sleepNow"] = sleepMillisNow();
+  JsonArray usage = reply["usage"].to<JsonArray>();
+  JsonArray sleep = reply["sleep"].to<JsonArray>();
+  // Predictions, from the currents measured in doc/ble-power.md. The latency
+  // is the average wait for an advertisement, weighted by when commands come.
+  float scheduledMilliAmps = 0;
+  float scheduledLatency = 0;
+  for (int hour=0; hour<24; hour++) {
+    uint32_t sleepMillis = sleepMillisForHour(hour);
+    usage.add(counts[hour]);
+    sleep.add(sleepMillis);
+    scheduledMilliAmps += _milliAmps(sleepMillis) / 24;
+    if (samples > 0) scheduledLatency += (float)counts[hour] / samples * sleepMillis / 2;
+  }
+  if (samples == 0) scheduledLatency = baseSleepMillis / 2.0;
+  float fixedMilliAmps = _milliAmps(baseSleepMillis);
+  JsonObject predicted = reply["predicted"].to<JsonObject>();
+  predicted["fixedMilliAmps"] = fixedMilliAmps;
+  predicted["scheduledMilliAmps"] = scheduledMilliAmps;
+  predicted["savingPercent"] = 100 * (fixedMilliAmps - scheduledMilliAmps) / fixedMilliAmps;
+  predicted["fixedLatencyMillis"] = baseSleepMillis / 2.0;
+  predicted["scheduledLatencyMillis"] = scheduledLatency;
+}
+
+bool UsageSchedule::putHandler(const JsonVariant& request) {
+  JsonObject reqObj = request.as<JsonObject>();
+  if (!reqObj) return false;
+  bool anyChanged = false;
+  if (getFromRequest<uint32_t>(reqObj, "minSleep", minSleepMillis)) anyChanged = true;
+  if (getFromRequest<uint32_t>(reqObj, "maxSleep", maxSleepMillis)) anyChanged = true;
+  _clampBounds();
+  return anyChanged;
+}
+
+void UsageSchedule::configLoad(IotsaConfigFileLoad& cf, const String& n_name) {
+  int value;
+  cf.get(n_name + ".minSleep", value, 500);
+  minSleepMillis = value;
+  cf.get(n_name + ".maxSleep", value, (int)Lissabon::Dimmer::maxSleepMillis);
+  maxSleepMillis = value;
+  _clampBounds();
+}
+
+void UsageSchedule::configSave(IotsaConfigFileSave& cf, const String& n_name) {
+  cf.put(n_name + ".minSleep", (int)minSleepMillis);
+  cf.put(n_name + ".maxSleep", (int)maxSleepMillis);
+}
+
+void ScheduledBatteryMod::_captureConfigured() {
+  configuredSleepDuration = sleepDuration;
+  if (schedule) schedule->setCycle(sleepDuration, wakeDuration);
+}
+
+void ScheduledBatteryMod::configLoad() {
+  IotsaBatteryMod::configLoad();
+  _captureConfigured();
+}
+
+void ScheduledBatteryMod::loop() {
+  if (schedule && configuredSleepDuration != 0 && millis() > lastApplyMillis + 1000) {
+    lastApplyMillis = millis();
+    schedule->setCycle(configuredSleepDuration, wakeDuration);
+    sleepDuration = schedule->sleepMillisNow();
+  }
+  IotsaBatteryMod::loop();
+}
+
+bool ScheduledBatteryMod::getHandler(const char *path, JsonObject& reply) {
+  uint32_t scheduledSleepDuration = sleepDuration;
+  _restoreConfigured();
+  bool rv = IotsaBatteryMod::getHandler(path, reply);
+  sleepDuration = scheduledSleepDuration;
+  reply["scheduledSleepDuration"] = scheduledSleepDuration;
+  return rv;
+}
+
+bool ScheduledBatteryMod::putHandler(const char *path, const JsonVariant& request, JsonObject& reply) {
+  // So a changed sleepDuration becomes the new base, and the scheduled one is never saved.
+  _restoreConfigured();
+  bool rv = IotsaBatteryMod::putHandler(path, request, reply);
+  _captureConfigured();
+  return rv;
+}
+
+};
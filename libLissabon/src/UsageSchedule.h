@@ -0,0 +1,94 @@
+#ifndef _USAGESCHEDULE_H_
+#define _USAGESCHEDULE_H_
+//
+// Adapts the light sleep period of a dimmer to when it is actually used.
+// Commands (BLE writes, local inputs, REST) are counted per hour of the day.
+// In hours with more than average use we sleep shorter, so a remote gets a
+// quicker response; in hours with less use (overnight) we sleep longer, up
+// to maxSleepMillis. If there have been no commands for a day (nobody home)
+// we sleep maxSleepMillis all the time. Until enough commands have been seen,
+// or if the configured sleepDuration is outside minSleepMillis..maxSleepMillis,
+// the configured sleepDuration is used unchanged.
+//
+// maxSleepMillis can't go above Lissabon::Dimmer::maxSleepMillis: clients
+// give up on a direct connect after directConnectTimeoutMillis, and would
+// fall back to scanning (or a full boot, for a deep-sleeping remote).
+//
+// Hours are taken from the system clock. If that hasn't been set they are
+// hours since boot: the pattern is still learned, only the reported hours
+// don't match the time of day.
+//
+#include "iotsa.h"
+#include "iotsaBattery.h"
+#include "AbstractDimmer.h"
+#include "LissabonBLE.h"
+
+namespace Lissabon {
+
+class UsageSchedule {
+public:
+  UsageSchedule(AbstractDimmer& _dimmer) : dimmer(_dimmer) {}
+  // Call from the module loop(). Commands are noticed through the dimmer's
+  // stateGeneration, so no other hooks are needed.
+  void loop();
+  // The configured cycle, set by ScheduledBatteryMod.
+  void setCycle(uint32_t _baseSleepMillis, uint32_t _wakeMillis) {
+    baseSleepMillis = _baseSleepMillis;
+    wakeMillis = _wakeMillis;
+  }
+  // Sleep duration for the current hour.
+  uint32_t sleepMillisNow() { return sleepMillisForHour(_currentHour()); }
+  uint32_t sleepMillisForHour(int hour);
+  void getHandler(JsonObject& reply);
+  bool putHandler(const JsonVariant& request);
+  void configLoad(IotsaConfigFileLoad& cf, const String& name);
+  void configSave(IotsaConfigFileSave& cf, const String& name);
+  // Bounds: sleeping shorter costs energy, sleeping longer makes the user wait.
+  uint32_t minSleepMillis = 500;
+  uint32_t maxSleepMillis = Lissabon::Dimmer::maxSleepMillis;
+protected:
+  int _currentHour();
+  bool _adaptive();
+  void _clampBounds();
+  bool _unoccupied();
+  float _milliAmps(uint32_t sleepMillis);
+  AbstractDimmer& dimmer;
+  uint32_t baseSleepMillis = 0;
+  uint32_t wakeMillis = 0;
+  bool started = false;
+  uint32_t lastGeneration = 0;
+  uint32_t lastCommandMillis = 0;
+  uint16_t counts[24] = {};
+  uint32_t samples = 0;
+  // Commands closer together than this (one session of fiddling) count once.
+  const uint32_t coalesceMillis = 60000;
+  // Below this many commands we use the configured sleep duration.
+  const uint32_t minSamples = 16;
+  // When this many commands are counted all counts are halved, so it follows changing habits.
+  const uint32_t decaySamples = 512;
+  // No commands for this long: assume nobody is there.
+  const uint32_t unoccupiedMillis = 24*3600*1000;
+  // From doc/ble-power.md: light sleep vs. awake with the radio on.
+  const float sleepMilliAmps = 7;
+  const float awakeMilliAmps = 60;
+};
+
+// Battery module that lets a UsageSchedule choose the sleep duration. The
+// configured sleepDuration is kept as the base, and is what is saved and reported.
+class ScheduledBatteryMod : public IotsaBatteryMod {
+public:
+  using IotsaBatteryMod::IotsaBatteryMod;
+  void setSchedule(UsageSchedule *_schedule) { schedule = _schedule; }
+  void configLoad() override;
+  void loop() override;
+protected:
+  bool getHandler(const char *path, JsonObject& reply) override;
+  bool putHandler(const char *path, const JsonVariant& request, JsonObject& reply) override;
+  void _restoreConfigured() { sleepDuration = configuredSleepDuration; }
+  void _captureConfigured();
+  UsageSchedule *schedule = nullptr;
+  uint32_t configuredSleepDuration = 0;
+  uint32_t lastApplyMillis = 0;
+};
+};
+#endif // _USAGESCHEDULE_H_
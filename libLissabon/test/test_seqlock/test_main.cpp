@@ -0,0 +1,68 @@
+//
+// Host test for Seqlock: a writer thread and reader threads hammer one
+// instance, and no reader may ever see a torn or out-of-order value.
+// Run with "pio test -e native" in libLissabon.
+//
+#include <unity.h>
+#include <atomic>
+#include <thread>
+#include "Seqlock.h"
+
+using namespace Lissabon;
+
+// Every field holds the same number, so a torn read shows as a mismatch.
+struct Value {
+  uint32_t a;
+  uint32_t b;
+  float level;
+  uint32_t c;
+};
+
+static const uint32_t nWrites = 2000000;
+
+static Value makeValue(uint32_t n) {
+  Value v;
+  v.a = n;
+  v.b = n;
+  v.level = n;
+  v.c = n;
+  return v;
+}
+
+void test_no_torn_reads() {
+  Seqlock<Value> lock;
+  std::atomic<bool> done{false};
+  std::atomic<uint32_t> torn{0};
+  std::atomic<uint32_t> backwards{0};
+  std::atomic<uint32_t> reads{0};
+  auto reader = [&]() {
+    uint32_t last = 0;
+    while (!done) {
+      Value v = lock.read();
+      if (v.a != v.b || v.b != v.c || v.level != (float)v.a) torn++;
+      if (v.a < last) backwards++;
+      last = v.a;
+      reads++;
+    }
+  };
+  std::thread reader1(reader);
+  std::thread reader2(reader);
+  std::thread writer([&]() {
+    for (uint32_t n=1; n<=nWrites; n++) lock.write(makeValue(n));
+    done = true;
+  });
+  writer.join();
+  reader1.join();
+  reader2.join();
+  TEST_ASSERT_EQUAL_UINT32(0, torn.load());
+  TEST_ASSERT_EQUAL_UINT32(0, backwards.load());
+  TEST_ASSERT_TRUE(reads.load() > 0);
+  TEST_ASSERT_EQUAL_UINT32(nWrites, lock.read().a);
+  TEST_ASSERT_EQUAL_UINT32(nWrites, lock.version());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_no_torn_reads);
+  return UNITY_END();
+}
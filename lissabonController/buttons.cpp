@@ -23,6 +23,8 @@ RotaryEncoder encoder(14, 2);
 #define ENCODER_STEPS 20
 Button button(0, true, true, true);
 #define SHORT_PRESS_DURATION 500
+// Pressing the button this long without turning the encoder switches all dimmers off.
+#define ALL_OFF_PRESS_DURATION 1500
 Button rockerUp(12, true, false, false);
 Button rockerDown(13, true, false, false);
 
@@ -107,12 +109,18 @@ Buttons::uiButtonPressed() {
   _tap();
   refreshEncoder();
 
-  if (!button.pressed && button.repeatCount == 0 && button.duration < SHORT_PRESS_DURATION) {
+  if (button.pressed) {
+    encoderTurnedWhilePressed = false;
+  } else if (button.repeatCount == 0 && button.duration < SHORT_PRESS_DURATION) {
     // Short press: turn current dimmer on or off
     LOG_UI IotsaSerial.println("LissabonCOntroller.Buttons.uiButtonPressed: dimmer on/off");
     controller->toggle();
+  } else if (button.duration >= ALL_OFF_PRESS_DURATION && !encoderTurnedWhilePressed) {
+    // Very long press without using the rotary: everything off
+    LOG_UI IotsaSerial.println("LissabonCOntroller.Buttons.uiButtonPressed: all off");
+    controller->allOff();
   } else {
-    // Long press: assume rotary will be used for selecting temperature
+    // Long press: assume rotary was used for selecting temperature
   }
   return true;
 }
@@ -133,6 +141,7 @@ Buttons::uiEncoderChanged() {
       f_value = 1.0;
       encoder.value = ENCODER_STEPS;
     }
+    encoderTurnedWhilePressed = true;
     LOG_UI IotsaSerial.printf("LissabonController.Buttons: now temperature=%f (int %d)\n", f_value, encoder.value);
     controller->setTemperature(f_value);
   } else 
@@ -14,6 +14,7 @@ public:
   virtual float getLevel() = 0;
   virtual void setLevel(float level) = 0;
   virtual void toggle() = 0;
+  virtual void allOff() = 0;
   virtual void showMessage(const char * message) = 0;
 };
 
@@ -34,5 +35,6 @@ private:
   uint32_t lastButtonChangeMillis = 0;
   int buttonChangeCount = 0;
   bool justWokeFromSleep = false;
+  bool encoderTurnedWhilePressed = false;
 };
 #endif // BUTTONS_H
\ No newline at end of file
@@ -1,16 +1,28 @@
 #include "iotsa.h"
 #include "display.h"
 
-#include <Wire.h>
 #include "Adafruit_GFX.h"
+#ifdef DISPLAY_WITH_MEMORY_BACKEND
+#include "memoryOled.h"
+typedef MemoryOled Oled;
+#else
+#include <Wire.h>
 #include "Adafruit_SSD1306.h"
+typedef Adafruit_SSD1306 Oled;
+#endif
+// The memory backend normally does the display task's work synchronously, so
+// results can be checked straight after a call. With -DDISPLAY_MEMORY_WITH_TASK
+// it uses the task and its notifications, as on the real panel.
+#if defined(DISPLAY_WITH_MEMORY_BACKEND) && !defined(DISPLAY_MEMORY_WITH_TASK)
+#define DISPLAY_WITHOUT_TASK
+#endif
 #define PIN_SDA 5
 #define PIN_SCL 4
 #define OLED_WIDTH 128
 #define OLED_HEIGHT 64
 #define DISPLAY_WIDTH 64
 #define DISPLAY_HEIGHT 128
-static Adafruit_SSD1306 *oled;
+static Oled *oled;
 
 #define STRIPS_X 2
 #define STRIPS_Y 2
@@ -22,7 +34,8 @@ static Adafruit_SSD1306 *oled;
 #define LABEL_X (ICON_WIDTH+STRIPS_X)
 #define ICON_X 0
 #define ICON_Y (-2)
-#define N_STRIPS 7
+#define N_STRIPS 7 // Visible at the same time
+#define SCROLLBAR_X (DISPLAY_WIDTH-1)
 
 #define SEPARATOR_Y (STRIPS_Y+STRIPS_HEIGHT*N_STRIPS+2)
 #define SEPARATOR_WIDTH 64
@@ -45,11 +58,24 @@ static Adafruit_SSD1306 *oled;
 #include "icons/sun.h"
 #include "icons/lightbulb.h"
 
+#define OLED_ADDRESS 0x3c
+#define OLED_PAGES (OLED_HEIGHT/8)
+// Bytes per I2C transmission: the control byte plus this must fit the Wire buffer.
+#define OLED_CHUNK 31
+
 Display::Display()
+: dirtyMinColumn(OLED_PAGES, OLED_WIDTH),
+  dirtyMaxColumn(OLED_PAGES, -1),
+  flushMinColumn(OLED_PAGES, OLED_WIDTH),
+  flushMaxColumn(OLED_PAGES, -1)
 {
+#ifdef DISPLAY_WITH_MEMORY_BACKEND
+  oled = new MemoryOled(OLED_WIDTH, OLED_HEIGHT);
+#else
   Wire.begin(PIN_SDA, PIN_SCL);
   oled = new Adafruit_SSD1306(OLED_WIDTH, OLED_HEIGHT, &Wire, -1);
-  if (!oled->begin(SSD1306_SWITCHCAPVCC, 0x3c, false, false)) {
+#endif
+  if (!oled->begin(SSD1306_SWITCHCAPVCC, OLED_ADDRESS, false, false)) {
     IFDEBUG IotsaSerial.println("OLED init failed");
     return;
   }
@@ -71,33 +97,276 @@ Display::Display()
   oled->drawXBitmap(TEMP_X+TEMP_WIDTH+1, TEMP_Y, sun_bits, sun_width, sun_height, WHITE);
 #endif
   oled->display();
+  lastFlushMillis = millis();
+  flushBuffer = (uint8_t *)malloc(OLED_WIDTH*OLED_PAGES);
+  if (flushBuffer == nullptr) return;
+#ifndef DISPLAY_WITHOUT_TASK
+  xTaskCreate(Display::_displayTaskEntry, "Display", 2048, this, 1, &displayTaskHandle);
+  if (displayTaskHandle == nullptr) return;
+#endif
+  ready = true;
+}
+
+void Display::_wakeTask() {
+#ifdef DISPLAY_WITHOUT_TASK
+  // No task: do its work right away, so results can be checked straight after the call.
+  _taskStep();
+#else
+  xTaskNotifyGive(displayTaskHandle);
+#endif
+}
+
+void Display::_markDirty(int x, int y, int w, int h) {
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > DISPLAY_WIDTH) w = DISPLAY_WIDTH - x;
+  if (y + h > DISPLAY_HEIGHT) h = DISPLAY_HEIGHT - y;
+  if (w <= 0 || h <= 0) return;
+  // Rotation 1: logical x is the OLED row, logical y runs right to left over the OLED columns.
+  int minColumn = OLED_WIDTH - (y + h);
+  int maxColumn = OLED_WIDTH - 1 - y;
+  for (int page = x / 8; page <= (x + w - 1) / 8; page++) {
+    if (minColumn < dirtyMinColumn[page]) dirtyMinColumn[page] = minColumn;
+    if (maxColumn > dirtyMaxColumn[page]) dirtyMaxColumn[page] = maxColumn;
+  }
+  anyDirty = true;
+}
+
+void Display::_startFlush() {
+  // Snapshot the changed parts, so we can continue drawing while they are sent.
+  uint8_t *buffer = oled->getBuffer();
+  for (int page = 0; page < OLED_PAGES; page++) {
+    int minColumn = dirtyMinColumn[page];
+    int maxColumn = dirtyMaxColumn[page];
+    flushMinColumn[page] = minColumn;
+    flushMaxColumn[page] = maxColumn;
+    if (minColumn > maxColumn) continue;
+    memcpy(flushBuffer + page*OLED_WIDTH + minColumn, buffer + page*OLED_WIDTH + minColumn, maxColumn - minColumn + 1);
+    dirtyMinColumn[page] = OLED_WIDTH;
+    dirtyMaxColumn[page] = -1;
+  }
+  anyDirty = false;
+  lastFlushMillis = millis();
+  flushRestores = restorePending;
+  restorePending = false;
+  flushBusy = true;
+  _wakeTask();
+}
+
+void Display::_displayTaskEntry(void *arg) {
+  Display *_this = reinterpret_cast<Display *>(arg);
+  _this->displayTask();
+}
+
+void Display::displayTask() {
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    _taskStep();
+  }
+}
+
+void Display::_taskStep() {
+  int value = wantDim.exchange(-1);
+  if (value >= 0) oled->dim(value);
+  value = wantInvert.exchange(-1);
+  if (value >= 0) oled->invertDisplay(value);
+  if (flushBusy) {
+    _sendFlush();
+    if (flushRestores) {
+      // The panel has its contents back, so it can come on now.
+      _command(SSD1306_DISPLAYON);
+      flushRestores = false;
+      uint32_t duration = micros() - powerUpStartMicros;
+      lastPowerUpMicros = duration;
+      if (duration > maxPowerUpMicros) maxPowerUpMicros = duration;
+      powerUps++;
+    }
+    flushBusy = false;
+  }
+  // After the flush, so a flush in progress still reaches the panel.
+  value = wantPower.exchange(-1);
+  if (value == 0) {
+    _command(SSD1306_DISPLAYOFF);
+    powerOffPending = false;
+  }
+}
+
+void Display::_command(uint8_t c) {
+  // Adafruit_SSD1306 sends every command as a separate transmission with a control byte.
+  oled->ssd1306_command(c);
+  i2cStats.transmissions++;
+  i2cStats.bytes += 2;
+}
+
+void Display::_sendFlush() {
+  // Like Adafruit_SSD1306::display(), but only the changed columns of the changed pages.
+  uint32_t bytesBefore = i2cStats.bytes;
+  for (int page = 0; page < OLED_PAGES; page++) {
+    int minColumn = flushMinColumn[page];
+    int maxColumn = flushMaxColumn[page];
+    if (minColumn > maxColumn) continue;
+    _command(SSD1306_PAGEADDR);
+    _command(page);
+    _command(page);
+    _command(SSD1306_COLUMNADDR);
+    _command(minColumn);
+    _command(maxColumn);
+    uint8_t *p = flushBuffer + page*OLED_WIDTH + minColumn;
+    int remaining = maxColumn - minColumn + 1;
+    while (remaining > 0) {
+      int count = remaining < OLED_CHUNK ? remaining : OLED_CHUNK;
+#ifdef DISPLAY_WITH_MEMORY_BACKEND
+      oled->data(p, count);
+#else
+      Wire.beginTransmission(OLED_ADDRESS);
+      Wire.write((uint8_t)0x40);
+      Wire.write(p, count);
+      Wire.endTransmission();
+#endif
+      i2cStats.transmissions++;
+      i2cStats.bytes += count + 1;
+      i2cStats.pixelBytes += count;
+      p += count;
+      remaining -= count;
+    }
+  }
+  uint32_t flushBytes = i2cStats.bytes - bytesBefore;
+  i2cStats.flushes++;
+  i2cStats.lastFlushBytes = flushBytes;
+  if (flushBytes > i2cStats.maxFlushBytes) i2cStats.maxFlushBytes = flushBytes;
 }
 
 void Display::flash() {
-  oled->fillRect(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT, INVERSE);
-  oled->display();
-  delay(200);
-  oled->fillRect(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT, INVERSE);
-  oled->display();
+  // The controller inverts the whole display, so we don't have to touch the framebuffer.
+  if (!ready) return;
+  flashEndMillis = millis() + flashDurationMillis;
+  if (flashEndMillis == 0) flashEndMillis = 1;
+  wantInvert = 1;
+  _wakeTask();
 }
 
 void Display::dim(bool _dim) {
-  oled->dim(_dim);
+  if (!ready) return;
+  wantDim = _dim;
+  _wakeTask();
+}
+
+void Display::setPower(bool on) {
+  if (!ready) return;
+  if (on != poweredDown) return;
+  if (!on) {
+    poweredDown = true;
+    restorePending = false;
+    powerOffPending = true;
+    wantPower = 0;
+    _wakeTask();
+    // We are probably about to sleep, so give the display task a moment
+    // to get the command to the panel.
+    for (int i=0; i<10 && powerOffPending; i++) vTaskDelay(pdMS_TO_TICKS(5));
+    return;
+  }
+  poweredDown = false;
+  powerUpStartMicros = micros();
+  // Our framebuffer is the reference copy, whatever the panel kept while it was off.
+  _markDirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+  restorePending = true;
+  // If a flush is still being sent loop() starts the restore later.
+  show();
+}
+
+void Display::getHandler(JsonObject& reply) {
+  JsonObject i2cReply = reply["i2c"].to<JsonObject>();
+  i2cReply["flushes"] = i2cStats.flushes;
+  i2cReply["transmissions"] = i2cStats.transmissions;
+  i2cReply["bytes"] = i2cStats.bytes;
+  i2cReply["pixelBytes"] = i2cStats.pixelBytes;
+  i2cReply["lastFlushBytes"] = i2cStats.lastFlushBytes;
+  i2cReply["maxFlushBytes"] = i2cStats.maxFlushBytes;
+  reply["poweredDown"] = poweredDown;
+  reply["powerUps"] = powerUps;
+  if (powerUps == 0) return;
+  reply["lastPowerUpMicros"] = lastPowerUpMicros;
+  reply["maxPowerUpMicros"] = maxPowerUpMicros;
+}
+
+void Display::getI2CStats(I2CStats& stats) {
+  stats = i2cStats;
+}
+
+void Display::resetI2CStats() {
+  i2cStats = I2CStats();
+}
+
+#ifdef DISPLAY_WITH_MEMORY_BACKEND
+String Display::pbm() {
+  return oled->pbm();
+}
+
+bool Display::panelMatchesFramebuffer() {
+  return oled->panelMatchesBuffer();
+}
+#endif
+
+int Display::visibleStripCount() {
+  return N_STRIPS;
+}
+
+void Display::setStripWindow(int first, int total) {
+  if (total != totalStrips) scrollbarDamaged = true;
+  totalStrips = total;
+  if (first == firstVisibleStrip) return;
+  // Remove the ring now, while we still know where it is. The rows are
+  // redrawn because their cached contents no longer match.
+  if (selectedStripOnDisplay >= 0) {
+    _drawSelection(selectedStripOnDisplay, false);
+    selectedStripOnDisplay = -1;
+  }
+  firstVisibleStrip = first;
+  scrollbarDamaged = true;
+}
+
+void Display::_drawScrollbar() {
+  int y = STRIPS_Y;
+  int h = STRIPS_HEIGHT*N_STRIPS;
+  oled->drawFastVLine(SCROLLBAR_X, y, h, BLACK);
+  if (totalStrips > N_STRIPS) {
+    int thumbY = y + h*firstVisibleStrip/totalStrips;
+    int thumbH = h*N_STRIPS/totalStrips;
+    if (thumbH < 2) thumbH = 2;
+    oled->drawFastVLine(SCROLLBAR_X, thumbY, thumbH, WHITE);
+  }
+  _markDirty(SCROLLBAR_X, y, 1, h);
 }
 
 void Display::clearStrips() {
   // xxxjack clear strip area
   // xxxjack show all in 0
   oled->fillRect(0, 0, DISPLAY_WIDTH, STRIPS_HEIGHT*N_STRIPS+4, BLACK);
+  _markDirty(0, 0, DISPLAY_WIDTH, STRIPS_HEIGHT*N_STRIPS+4);
   //addStrip(0, "ALL", true);
+  stripRows.clear();
   selectedStripOnDisplay = -1;
+  scrollbarDamaged = true;
 }
 
 void Display::addStrip(int index, String name, StripStatus status) {
+  int slot = index - firstVisibleStrip;
+  if (slot < 0 || slot >= N_STRIPS) return;
+  if (slot >= stripRows.size()) stripRows.resize(slot+1);
+  StripRow& row = stripRows[slot];
+  if (row.drawn && row.name == name && row.status == status) return;
+  row.drawn = true;
+  row.name = name;
+  row.status = status;
   // xxxjack show name in index
   int x = LABEL_X;
-  int y = STRIPS_Y + index*STRIPS_HEIGHT;
-  oled->fillRect(0, y, DISPLAY_WIDTH, STRIPS_HEIGHT+2, BLACK);
+  int y = STRIPS_Y + slot*STRIPS_HEIGHT;
+  // Exactly this row's band: the icon and the selection ring start ICON_Y
+  // above the text, and the next row starts STRIPS_HEIGHT further down.
+  // The scrollbar column is left alone.
+  oled->fillRect(0, y+ICON_Y, SCROLLBAR_X, STRIPS_HEIGHT, BLACK);
+  _markDirty(0, y+ICON_Y, SCROLLBAR_X, STRIPS_HEIGHT);
+  if (slot == selectedStripOnDisplay) selectionDamaged = true;
   oled->setCursor(x, y);
   oled->print(name.c_str());
   // If the strip is available we show a connected/not connected indicator
@@ -112,34 +381,62 @@ void Display::addStrip(int index, String name, StripStatus status) {
   }
 }
 
+void Display::_drawSelection(int slot, bool on) {
+  int x = LABEL_X-2;
+  int y = STRIPS_Y + slot*STRIPS_HEIGHT - 2;
+  // Stop short of the scrollbar column, erasing the ring would break the thumb.
+  int w = SCROLLBAR_X - x;
+  oled->drawRoundRect(x, y, w, STRIPS_HEIGHT, 3, on ? WHITE : BLACK);
+  _markDirty(x, y, w, STRIPS_HEIGHT);
+}
+
 void Display::selectStrip(int index) {
+  if (scrollbarDamaged) {
+    scrollbarDamaged = false;
+    _drawScrollbar();
+  }
+  int slot = index - firstVisibleStrip;
+  if (index < 0 || slot < 0 || slot >= N_STRIPS) slot = -1;
+  if (slot == selectedStripOnDisplay && !selectionDamaged) return;
+  selectionDamaged = false;
   // xxxjack clear ring around selected
   if (selectedStripOnDisplay >= 0) {
-    int x = LABEL_X-2;
-    int y = STRIPS_Y + selectedStripOnDisplay*STRIPS_HEIGHT - 2;
-    oled->drawRoundRect(x, y, LABEL_WIDTH+4, STRIPS_HEIGHT, 3, BLACK);
+    _drawSelection(selectedStripOnDisplay, false);
   }
 
-  selectedStripOnDisplay = index;
+  selectedStripOnDisplay = slot;
   if (selectedStripOnDisplay >= 0) {
     // xxxjack draw ring around selected
-    int x = LABEL_X-2;
-    int y = STRIPS_Y + selectedStripOnDisplay*STRIPS_HEIGHT - 2;
-    oled->drawRoundRect(x, y, LABEL_WIDTH+4, STRIPS_HEIGHT, 3, WHITE);
+    _drawSelection(selectedStripOnDisplay, true);
   }
 }
 
 void Display::clearLevel() {
   oled->fillRect(LEVEL_X, LEVEL_Y, LEVEL_WIDTH, LEVEL_HEIGHT, BLACK);
+  _markDirty(LEVEL_X, LEVEL_Y, LEVEL_WIDTH, LEVEL_HEIGHT);
+  levelDrawn = false;
 }
 
-void Display::setLevel(float level, bool on, float wantedLevel) {
+void Display::setLevel(float level, bool on, float wantedLevel, bool pending) {
+  if (levelDrawn && level == drawnLevel && on == drawnOn && wantedLevel == drawnWantedLevel && pending == drawnLevelPending) return;
   clearLevel();
+  levelDrawn = true;
+  drawnLevel = level;
+  drawnOn = on;
+  drawnWantedLevel = wantedLevel;
+  drawnLevelPending = pending;
   oled->drawRect(LEVEL_X, LEVEL_Y, LEVEL_WIDTH, LEVEL_HEIGHT, WHITE);
-  if (on) {
+  if (on && pending) {
+    // Striped in stead of solid until the dimmer has confirmed
+    for (int x=0; x<int(level*LEVEL_WIDTH); x+=2) {
+      oled->drawFastVLine(LEVEL_X+x, LEVEL_Y, LEVEL_HEIGHT, WHITE);
+    }
+  } else if (on) {
     oled->fillRect(LEVEL_X, LEVEL_Y, int(level*LEVEL_WIDTH), LEVEL_HEIGHT, WHITE);
   } else {
     oled->drawFastVLine(LEVEL_X+int(level*LEVEL_WIDTH), LEVEL_Y, LEVEL_HEIGHT, WHITE);
+    // At level 1 that line is just right of the bar
+    _markDirty(LEVEL_X+LEVEL_WIDTH, LEVEL_Y, 1, LEVEL_HEIGHT);
   }
   if (wantedLevel >= 0) {
     int wantedLPos = int(wantedLevel*(LEVEL_WIDTH-2));
@@ -152,17 +449,30 @@ void Display::clearTemp() {
 #ifdef DIMMER_WITH_TEMPERATURE
   // xxxjack clear color area
   oled->fillRect(TEMP_X, TEMP_Y, TEMP_WIDTH, TEMP_HEIGHT, BLACK);
+  _markDirty(TEMP_X, TEMP_Y, TEMP_WIDTH, TEMP_HEIGHT);
+  tempDrawn = false;
 #endif
 }
 
-void Display::setTemp(float color) {
+void Display::setTemp(float color, bool pending) {
 #ifdef DIMMER_WITH_TEMPERATURE
+  if (tempDrawn && color == drawnTemp && pending == drawnTempPending) return;
   clearTemp();
+  tempDrawn = true;
+  drawnTemp = color;
+  drawnTempPending = pending;
   oled->drawRect(TEMP_X, TEMP_Y, TEMP_WIDTH, TEMP_HEIGHT, WHITE);
   int tempPos = int(color*TEMP_WIDTH);
   if (tempPos <= 0) tempPos = 1;
   if (tempPos >= TEMP_WIDTH-1) tempPos = TEMP_WIDTH-2;
-  oled->drawFastVLine(TEMP_X+tempPos, TEMP_Y, TEMP_HEIGHT, WHITE);
+  if (pending) {
+    // Dotted until the dimmer has confirmed
+    for (int y=0; y<TEMP_HEIGHT; y+=2) {
+      oled->drawPixel(TEMP_X+tempPos, TEMP_Y+y, WHITE);
+    }
+  } else {
+    oled->drawFastVLine(TEMP_X+tempPos, TEMP_Y, TEMP_HEIGHT, WHITE);
+  }
 #endif
 }
 
@@ -178,11 +488,30 @@ void Display::showActivity(const char *activity) {
 }
 
 void Display::_updateActivity(const char *activity) {
+  if (activity == nullptr) activity = "";
+  if (drawnActivity == activity) return;
+  drawnActivity = activity;
   oled->fillRect(ACTIVITY_X, ACTIVITY_Y, ACTIVITY_WIDTH, ACTIVITY_HEIGHT, BLACK);
+  _markDirty(ACTIVITY_X, ACTIVITY_Y, ACTIVITY_WIDTH, ACTIVITY_HEIGHT);
   oled->setCursor(ACTIVITY_X, ACTIVITY_Y);
-  if (activity && activity[0]) oled->print(activity);
+  if (activity[0]) oled->print(activity);
 }
 
 void Display::show() {
-  oled->display();
+  if (!anyDirty || !ready) return;
+  // Changes made while the panel is off are sent with the restore.
+  if (poweredDown) return;
+  if (flushBusy) return;
+  if (!restorePending && millis() - lastFlushMillis < minFlushIntervalMillis) return;
+  _startFlush();
+}
+
+void Display::loop() {
+  if (flashEndMillis != 0 && (int32_t)(millis() - flashEndMillis) >= 0) {
+    flashEndMillis = 0;
+    wantInvert = 0;
+    _wakeTask();
+  }
+  // Changes that show() had to hold back, or that were drawn without a show().
+  show();
 }
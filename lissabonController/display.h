@@ -1,5 +1,7 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
+#include <vector>
+#include <atomic>
 
 enum StripStatus {
   unavailable,
@@ -13,22 +15,121 @@ public:
   
   Display();
   void dim(bool _dim);
+  // Switches the panel off (before sleep) or on. Drawing continues in our
+  // framebuffer while it is off, and on power-up the whole framebuffer is sent
+  // in one flush before the panel is switched on again.
+  void setPower(bool on);
+  void getHandler(JsonObject& reply);
+  // What has been sent to the OLED, to see what redraws cost.
+  struct I2CStats {
+    uint32_t flushes = 0;
+    uint32_t transmissions = 0;
+    uint32_t bytes = 0;       // Including control bytes and commands
+    uint32_t pixelBytes = 0;  // Display data only
+    uint32_t lastFlushBytes = 0;
+    uint32_t maxFlushBytes = 0;
+  };
+  void getI2CStats(I2CStats& stats);
+  void resetI2CStats();
+#ifdef DISPLAY_WITH_MEMORY_BACKEND
+  // What the panel shows, as a PBM image (portrait, as the user sees it).
+  String pbm();
+  // False if a partial flush missed a change.
+  bool panelMatchesFramebuffer();
+#endif
+  // Inverts the whole display for a moment. Doesn't wait for that.
   void flash();
+  // Drawing only changes the framebuffer. show() hands a copy of the changed
+  // parts to the display task, which sends them to the OLED while we carry
+  // on. At most once per minFlushIntervalMillis, and only one transfer at a
+  // time: otherwise loop() does it later. Call loop() often.
   void show();
+  void loop();
+  // The strip list shows a window of visibleStripCount() strips out of total.
+  // addStrip() and selectStrip() take the index in the whole list, and ignore
+  // strips outside the window.
+  int visibleStripCount();
+  void setStripWindow(int first, int total);
   void clearStrips();
   void addStrip(int index, String name, StripStatus status);
   void selectStrip(int index);
   
   void clearLevel();
-  void setLevel(float level, bool on, float wantedLevel = -1);
+  // pending: the value has been requested but not confirmed by the dimmer yet.
+  void setLevel(float level, bool on, float wantedLevel = -1, bool pending = false);
   void clearTemp();
-  void setTemp(float temperature);
+  void setTemp(float temperature, bool pending = false);
   void showScanning(bool _isScanning);
   void showActivity(const char *activity);
 private:
   void _updateActivity(const char *activity);
-  int selectedStripOnDisplay = -1;
+  void _drawSelection(int slot, bool on);
+  void _drawScrollbar();
+  int firstVisibleStrip = 0;
+  int totalStrips = 0;
+  bool scrollbarDamaged = false;
+  // Dirty regions, in logical (rotated) coordinates.
+  void _markDirty(int x, int y, int w, int h);
+  void _startFlush();
+  // The display task does all I2C traffic once it is running.
+  static void _displayTaskEntry(void *arg);
+  void displayTask();
+  void _sendFlush();
+  void _command(uint8_t c);
+  // Runs the display task (or, without one, the same work right now).
+  void _wakeTask();
+  void _taskStep();
+  bool ready = false;
+  TaskHandle_t displayTaskHandle = nullptr;
+  I2CStats i2cStats;
+  // Copy of the framebuffer, only the parts in flushMinColumn/flushMaxColumn are valid.
+  // Owned by the display task while flushBusy is set.
+  uint8_t *flushBuffer = nullptr;
+  std::vector<int> flushMinColumn;
+  std::vector<int> flushMaxColumn;
+  std::atomic<bool> flushBusy{false};
+  // Commands for the display task, -1 if nothing to do.
+  std::atomic<int> wantDim{-1};
+  std::atomic<int> wantInvert{-1};
+  std::atomic<int> wantPower{-1};
+  // Set by setPower(false), cleared by the display task once SSD1306_DISPLAYOFF has been sent.
+  std::atomic<bool> powerOffPending{false};
+  bool poweredDown = false;
+  // Set by setPower(true) until the restore has been handed to the display task.
+  bool restorePending = false;
+  // The flush in flushBuffer is a restore: switch the panel on after sending it.
+  std::atomic<bool> flushRestores{false};
+  // Time to first pixel: from setPower(true) until the panel is on again.
+  uint32_t powerUpStartMicros = 0;
+  uint32_t powerUps = 0;
+  uint32_t lastPowerUpMicros = 0;
+  uint32_t maxPowerUpMicros = 0;
+  uint32_t flashEndMillis = 0;
+  const uint32_t flashDurationMillis = 200;
+  int selectedStripOnDisplay = -1; // slot in the window, not index
+  bool selectionDamaged = false;
   bool isScanning = false;
+  // What is currently drawn, so unchanged parts aren't redrawn (and sent) again.
+  // stripRows is per slot in the window.
+  struct StripRow {
+    bool drawn = false;
+    String name;
+    StripStatus status;
+  };
+  std::vector<StripRow> stripRows;
+  bool levelDrawn = false;
+  float drawnLevel, drawnWantedLevel;
+  bool drawnOn, drawnLevelPending;
+  bool tempDrawn = false;
+  float drawnTemp;
+  bool drawnTempPending;
+  String drawnActivity;
+  // Per OLED page (8 pixel rows) the range of changed columns, empty if min > max.
+  std::vector<int> dirtyMinColumn;
+  std::vector<int> dirtyMaxColumn;
+  bool anyDirty = false;
+  uint32_t lastFlushMillis = 0;
+  const uint32_t minFlushIntervalMillis = 40;
  };
 
 #endif // DISPLAY_H
\ No newline at end of file
@@ -74,6 +74,7 @@ public:
   float getLevel() override;
   void setLevel(float level) override;
   void toggle() override;
+  void allOff() override;
   void sleepWakeupNotification(bool sleep) override;
 
 protected:
@@ -92,7 +93,15 @@ private:
   void handler();
   Buttons buttons;
   DimmerDynamicCollection::ItemType* getDimmerForCommand(int num);
+  float _temperatureFraction(DimmerDynamicCollection::ItemType *d);
+  // Requests a redraw, which loop() does. So a burst of callbacks causes one redraw.
   void updateDisplay(bool clear);
+  void _redrawDisplay();
+  bool displayUpdateNeeded = false;
+  bool displayClearNeeded = false;
+  int stripsOnDisplay = -1;
+  // First dimmer in the display's strip list window, moved to keep the selected one in view.
+  int firstVisibleDimmer = 0;
   typedef std::pair<std::string, BLEAddress> unknownDimmerInfo;
   DimmerDynamicCollection dimmers;
   DimmerDynamicCollection::ItemType* dimmerFactory(int num);
@@ -126,8 +135,8 @@ IotsaLedstripControllerMod::selectDimmer(bool next, bool prev) {
   buttons.refreshEncoder();
   iotsaConfig.postponeSleep(4000);
   if (selectedDimmerIndex < dimmers.size()) {
-    auto d = dimmers.at(selectedDimmerIndex);
-    bool availableNow = d->available();
+    BLEDimmer *d = reinterpret_cast<BLEDimmer *>(dimmers.at(selectedDimmerIndex));
+    bool availableNow = d->status().available;
     bool mustUpdate = availableNow && !selectedDimmerIsAvailable;
     selectedDimmerIsAvailable = availableNow;
     if (mustUpdate) {
@@ -138,16 +147,20 @@ IotsaLedstripControllerMod::selectDimmer(bool next, bool prev) {
 }
 
 float IotsaLedstripControllerMod::getTemperature() {
-#ifdef DIMMER_WITH_TEMPERATURE
   auto d = getDimmerForCommand(selectedDimmerIndex);
-  if (d) {
-    float rv = (d->temperature - DIMMER_MIN_TEMPERATURE) / (DIMMER_MAX_TEMPERATURE - DIMMER_MIN_TEMPERATURE);
-    if (rv < 0) rv = 0;
-    if (rv > 1) rv = 1;
-    return rv;
-  }
-#endif
+  if (d) return _temperatureFraction(d);
+  return 0;
+}
+
+float IotsaLedstripControllerMod::_temperatureFraction(DimmerDynamicCollection::ItemType *d) {
+#ifdef DIMMER_WITH_TEMPERATURE
+  float rv = (d->temperature - DIMMER_MIN_TEMPERATURE) / (DIMMER_MAX_TEMPERATURE - DIMMER_MIN_TEMPERATURE);
+  if (rv < 0) rv = 0;
+  if (rv > 1) rv = 1;
+  return rv;
+#else
   return 0;
+#endif
 }
 
 void IotsaLedstripControllerMod::setTemperature(float temperature) {
@@ -161,7 +174,7 @@ void IotsaLedstripControllerMod::setTemperature(float temperature) {
   if (tempKelvin < DIMMER_MIN_TEMPERATURE) tempKelvin = DIMMER_MIN_TEMPERATURE;
   if (tempKelvin > DIMMER_MAX_TEMPERATURE) tempKelvin = DIMMER_MAX_TEMPERATURE;
   d->temperature = tempKelvin;
-  d->updateDimmer();
+  d->updateDimmerStreaming();
   updateDisplay(false);
   LOG_UI IotsaSerial.printf("LissabonController: updated dimmer %d temperature %f\n", selectedDimmerIndex, temperature);
   iotsaConfig.postponeSleep(4000);
@@ -183,7 +196,8 @@ void IotsaLedstripControllerMod::setLevel(float level) {
     return;
   }
   d->level = level;
-  d->updateDimmer();
+  // Called for every encoder step: intermediate values are streamed.
+  d->updateDimmerStreaming();
   updateDisplay(false);
   LOG_UI IotsaSerial.printf("LissabonController: updated dimmer %d level %f\n", selectedDimmerIndex, level);
   if (selectedDimmerIndex != savedSelectedDimmerIndex) saveNeeded = true;
@@ -200,31 +214,62 @@ void IotsaLedstripControllerMod::toggle() {
   }
 }
 
+void IotsaLedstripControllerMod::allOff() {
+  DimmerCollection::GroupState state;
+  state.isOn = 0;
+  int count = dimmers.applyToGroup({}, state);
+  LOG_UI IotsaSerial.printf("LissabonController: all %d dimmers off\n", count);
+  display->showActivity("all off");
+  updateDisplay(false);
+  iotsaConfig.postponeSleep(4000);
+}
+
 void 
 IotsaLedstripControllerMod::updateDisplay(bool clear) {
-  LOG_BLE IotsaSerial.printf("LissabonController: %d strips:\n", dimmers.size());
+  displayUpdateNeeded = true;
+  if (clear) displayClearNeeded = true;
+}
 
-  if (true || clear) display->clearStrips();
-  int index = 0;
-  for (auto& _elem : dimmers) {
+void 
+IotsaLedstripControllerMod::_redrawDisplay() {
+  LOG_BLE IotsaSerial.printf("LissabonController: %d strips:\n", dimmers.size());
+  displayUpdateNeeded = false;
+  // The display only redraws (and sends) rows that changed, but it doesn't know about removed ones.
+  if (displayClearNeeded || dimmers.size() != stripsOnDisplay) display->clearStrips();
+  displayClearNeeded = false;
+  stripsOnDisplay = dimmers.size();
+  // Only the dimmers in the window are drawn, so this doesn't get slower with more dimmers.
+  int visible = display->visibleStripCount();
+  if (selectedDimmerIndex >= 0 && selectedDimmerIndex < firstVisibleDimmer) firstVisibleDimmer = selectedDimmerIndex;
+  if (selectedDimmerIndex >= firstVisibleDimmer + visible) firstVisibleDimmer = selectedDimmerIndex - visible + 1;
+  if (firstVisibleDimmer > dimmers.size() - visible) firstVisibleDimmer = dimmers.size() - visible;
+  if (firstVisibleDimmer < 0) firstVisibleDimmer = 0;
+  display->setStripWindow(firstVisibleDimmer, dimmers.size());
+  int lastVisibleDimmer = min(dimmers.size(), firstVisibleDimmer + visible);
+  for (int index = firstVisibleDimmer; index < lastVisibleDimmer; index++) {
     // Living dangerously: we don't have rtti so we can't use dynamic cast.
     // We know that is safe because we supplied the factory function.
-    BLEDimmer* elem = reinterpret_cast<BLEDimmer *>(_elem);
+    BLEDimmer* elem = reinterpret_cast<BLEDimmer *>(dimmers.at(index));
     String name = elem->getUserVisibleName();
-    LOG_BLE IotsaSerial.printf("  device %s, available=%d connected=%d\n", name.c_str(), elem->available(), elem->isConnected());
+    BLEDimmer::Status elemStatus = elem->status();
+    LOG_BLE IotsaSerial.printf("  device %s, available=%d connected=%d\n", name.c_str(), elemStatus.available, elemStatus.connected);
     StripStatus status = StripStatus::unavailable;
-    if (elem->available()) status = StripStatus::available;
-    if (elem->isConnecting()) status = StripStatus::connecting;
-    if (elem->isConnected()) status = StripStatus::connected;
+    if (elemStatus.available) status = StripStatus::available;
+    if (elemStatus.connecting) status = StripStatus::connecting;
+    if (elemStatus.connected) status = StripStatus::connected;
     display->addStrip(index, name, status);
-    index++;
   }
   display->selectStrip(selectedDimmerIndex);
   if (selectedDimmerIndex >= 0) {
-    auto d = dimmers.at(selectedDimmerIndex);
-    if (d && d->available() && d->dataValid()) {
+    BLEDimmer *d = reinterpret_cast<BLEDimmer *>(dimmers.at(selectedDimmerIndex));
+    if (d && d->status().pending) {
+      // Show what was asked for straight away, marked as not confirmed yet.
+      // The dimmer rolls the values back if the request fails.
+      display->setLevel(d->level, d->isOn, -1, true);
+      display->setTemp(_temperatureFraction(d), true);
+    } else if (d && d->status().available && d->status().dataValid) {
       display->setLevel(d->level, d->isOn);
-      display->setTemp(getTemperature());
+      display->setTemp(_temperatureFraction(d));
     } else {
       display->clearLevel();
       display->clearTemp();
@@ -244,12 +289,13 @@ IotsaLedstripControllerMod::getDimmerForCommand(int num) {
     IotsaSerial.printf("LissabonController: Dimmer %d does not exist\n", num);
     return nullptr;
   }
-  if (!d->available()) {
+  BLEDimmer::Status status = reinterpret_cast<BLEDimmer *>(d)->status();
+  if (!status.available) {
     IotsaSerial.printf("LissabonController: Dimmer %d unavailable\n", num);
     updateScanning();
     return nullptr;
   }
-  if (!d->dataValid()) {
+  if (!status.dataValid) {
     IotsaSerial.printf("LissabonController: Dimmer %d current status unknown\n", num);
     return nullptr;
   }
@@ -387,6 +433,10 @@ String IotsaLedstripControllerMod::info() {
 bool IotsaLedstripControllerMod::getHandler(const char *path, JsonObject& reply) {
   IotsaBLEClientMod::getHandler(path, reply);
   dimmers.getHandler(reply);
+  JsonObject workerReply = reply["bleWorker"].to<JsonObject>();
+  BLEDimmerWorker::instance().getHandler(workerReply);
+  JsonObject displayReply = reply["display"].to<JsonObject>();
+  display->getHandler(displayReply);
   return true;
 }
 
@@ -489,13 +539,16 @@ void IotsaLedstripControllerMod::unknownBLEDimmerFound(const BLEAdvertisedDevice
 void IotsaLedstripControllerMod::knownBLEDimmerChanged(const BLEAdvertisedDevice& deviceAdvertisement) {
   std::string name = deviceAdvertisement.getName();
   LOG_BLE IotsaSerial.printf("LissabonController: knownDeviceChanged: device \"%s\"\n", name.c_str());
+  auto d = dimmers.find(String(name.c_str()));
+  if (d) reinterpret_cast<BLEDimmer *>(d)->updateStatus();
   dimmerAvailableChanged();
 }
 
 void IotsaLedstripControllerMod::sleepWakeupNotification(bool sleep) 
 {
   IotsaSerial.printf("LissabonController: sleep %d\n", (int)sleep);
-  display->dim(sleep);
+  // Switch the panel off while we sleep, it is restored from our framebuffer on wakeup.
+  display->setPower(!sleep);
   if (!sleep) {
     buttons.justAwake();
   }
@@ -523,11 +576,13 @@ void IotsaLedstripControllerMod::loop() {
     // Living dangerously: we don't have rtti so we can't use dynamic cast.
     // We know that is safe because we supplied the factory function.
     BLEDimmer* d_ble = reinterpret_cast<BLEDimmer*>(d);
-    if (d_ble->available()) {
-      if ((d_ble->isConnected() || d_ble->isConnecting())) {
+    // The cached status: querying the BLE objects for every dimmer in every loop is too expensive.
+    BLEDimmer::Status status = d_ble->status();
+    if (status.available) {
+      if (status.connected || status.connecting) {
         isIdle = false;
       }
-      if (!d_ble->dataValid()) {
+      if (!status.dataValid) {
         needsRefresh = d_ble;
       }
     }
@@ -540,9 +595,14 @@ void IotsaLedstripControllerMod::loop() {
     }
     if (needsRefresh != nullptr) {
       IotsaSerial.printf("LissabonController: refresh idle dimmer %d\n", needsRefresh->num);
-      needsRefresh->refresh();
+      needsRefresh->refreshInBackground();
     }
   }
+  //
+  // Redraw the display if anything asked for it, and send changes to the OLED.
+  //
+  if (displayUpdateNeeded) _redrawDisplay();
+  display->loop();
 }
 
 // Instantiate the Led module, and install it in the framework
@@ -0,0 +1,127 @@
+#ifdef DISPLAY_WITH_MEMORY_BACKEND
+#include "iotsa.h"
+#include "memoryOled.h"
+
+MemoryOled::MemoryOled(int16_t w, int16_t h)
+: Adafruit_GFX(w, h)
+{
+}
+
+MemoryOled::~MemoryOled() {
+  free(buffer);
+  free(panel);
+}
+
+bool MemoryOled::begin(uint8_t vccstate, uint8_t i2caddr, bool reset, bool periphBegin) {
+  buffer = (uint8_t *)calloc(WIDTH*pages(), 1);
+  panel = (uint8_t *)calloc(WIDTH*pages(), 1);
+  if (buffer == nullptr || panel == nullptr) return false;
+  pageEnd = pages()-1;
+  columnEnd = WIDTH-1;
+  panelOn = true;
+  return true;
+}
+
+void MemoryOled::drawPixel(int16_t x, int16_t y, uint16_t color) {
+  // Same as Adafruit_SSD1306::drawPixel().
+  if (x < 0 || x >= width() || y < 0 || y >= height()) return;
+  int16_t t;
+  switch (getRotation()) {
+  case 1:
+    t = x; x = y; y = t;
+    x = WIDTH - x - 1;
+    break;
+  case 2:
+    x = WIDTH - x - 1;
+    y = HEIGHT - y - 1;
+    break;
+  case 3:
+    t = x; x = y; y = t;
+    y = HEIGHT - y - 1;
+    break;
+  }
+  uint8_t& b = buffer[x + (y/8)*WIDTH];
+  switch (color) {
+  case WHITE: b |= (1 << (y&7)); break;
+  case BLACK: b &= ~(1 << (y&7)); break;
+  case INVERSE: b ^= (1 << (y&7)); break;
+  }
+}
+
+void MemoryOled::clearDisplay() {
+  memset(buffer, 0, WIDTH*pages());
+}
+
+void MemoryOled::display() {
+  ssd1306_command(SSD1306_PAGEADDR);
+  ssd1306_command(0);
+  ssd1306_command(pages()-1);
+  ssd1306_command(SSD1306_COLUMNADDR);
+  ssd1306_command(0);
+  ssd1306_command(WIDTH-1);
+  data(buffer, WIDTH*pages());
+}
+
+void MemoryOled::ssd1306_command(uint8_t c) {
+  if (partialCommand) {
+    args[argsSeen++] = c;
+    if (argsSeen < 2) return;
+    if (partialCommand == SSD1306_PAGEADDR) {
+      pageStart = page = args[0];
+      pageEnd = args[1];
+    } else {
+      columnStart = column = args[0];
+      columnEnd = args[1];
+    }
+    partialCommand = 0;
+    return;
+  }
+  switch (c) {
+  case SSD1306_PAGEADDR:
+  case SSD1306_COLUMNADDR:
+    partialCommand = c;
+    argsSeen = 0;
+    break;
+  case SSD1306_DISPLAYOFF:
+    panelOn = false;
+    break;
+  case SSD1306_DISPLAYON:
+    panelOn = true;
+    break;
+  }
+}
+
+void MemoryOled::data(const uint8_t *p, int count) {
+  while (count-- > 0) {
+    panel[column + page*WIDTH] = *p++;
+    if (++column > columnEnd) {
+      column = columnStart;
+      if (++page > pageEnd) page = pageStart;
+    }
+  }
+}
+
+String MemoryOled::pbm() {
+  String rv = "P1\n" + String(width()) + " " + String(height()) + "\n";
+  for (int y=0; y<height(); y++) {
+    for (int x=0; x<width(); x++) {
+      // Inverse of the rotation in drawPixel(), for the current rotation only.
+      int px = x, py = y;
+      switch (getRotation()) {
+      case 1: px = WIDTH - y - 1; py = x; break;
+      case 2: px = WIDTH - x - 1; py = HEIGHT - y - 1; break;
+      case 3: px = y; py = HEIGHT - x - 1; break;
+      }
+      bool on = panelOn && (panel[px + (py/8)*WIDTH] & (1 << (py&7)));
+      if (panelOn && inverted) on = !on;
+      rv += on ? '1' : '0';
+    }
+    rv += '\n';
+  }
+  return rv;
+}
+
+bool MemoryOled::panelMatchesBuffer() {
+  return memcmp(panel, buffer, WIDTH*pages()) == 0;
+}
+#endif // DISPLAY_WITH_MEMORY_BACKEND
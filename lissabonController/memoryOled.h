@@ -0,0 +1,60 @@
+#ifndef MEMORYOLED_H
+#define MEMORYOLED_H
+//
+// Stand-in for Adafruit_SSD1306 that needs no hardware, enabled with
+// -DDISPLAY_WITH_MEMORY_BACKEND. Drawing goes into a framebuffer with the
+// same layout as the real one. Commands and data are interpreted like the
+// SSD1306 does, into a copy of the panel RAM, so we can check what the
+// panel would show after a series of (partial) flushes.
+//
+#include "Adafruit_GFX.h"
+
+#ifndef SSD1306_SWITCHCAPVCC
+#define SSD1306_SWITCHCAPVCC 0x02
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_DISPLAYOFF 0xAE
+#define SSD1306_DISPLAYON 0xAF
+#define SSD1306_BLACK 0
+#define SSD1306_WHITE 1
+#define SSD1306_INVERSE 2
+#define BLACK SSD1306_BLACK
+#define WHITE SSD1306_WHITE
+#define INVERSE SSD1306_INVERSE
+#endif
+
+class MemoryOled : public Adafruit_GFX {
+public:
+  MemoryOled(int16_t w, int16_t h);
+  ~MemoryOled();
+  bool begin(uint8_t vccstate, uint8_t i2caddr, bool reset, bool periphBegin);
+  void drawPixel(int16_t x, int16_t y, uint16_t color) override;
+  void clearDisplay();
+  // Full update, like Adafruit_SSD1306::display().
+  void display();
+  void dim(bool _dim) { dimmed = _dim; }
+  void invertDisplay(bool i) override { inverted = i; }
+  uint8_t *getBuffer() { return buffer; }
+  void ssd1306_command(uint8_t c);
+  // Display data, as sent after the 0x40 control byte.
+  void data(const uint8_t *p, int count);
+  // Panel contents as the user sees them (rotation applied), as a plain PBM.
+  String pbm();
+  // True if the panel shows exactly what is in the framebuffer.
+  bool panelMatchesBuffer();
+  bool panelOn = false;
+  bool dimmed = false;
+  bool inverted = false;
+private:
+  int pages() { return HEIGHT / 8; }
+  uint8_t *buffer = nullptr;
+  uint8_t *panel = nullptr;
+  // SSD1306 horizontal addressing mode state.
+  int pageStart = 0, pageEnd = 0, columnStart = 0, columnEnd = 0;
+  int page = 0, column = 0;
+  uint8_t partialCommand = 0;
+  int argsSeen = 0;
+  uint8_t args[2];
+};
+
+#endif // MEMORYOLED_H
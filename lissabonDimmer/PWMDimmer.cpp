@@ -46,40 +46,24 @@ bool PWMDimmer::available() {
 
 void PWMDimmer::identify() {
   IotsaSerial.printf("xxxjack identify dimmer%d channel %d pin %d\n", num, channel, pin);
+  // Two rapid flashes at half brightness, shown by loop().
+  startEffect(2, 100, 100, 0.5);
+}
+
+void PWMDimmer::loop() {
+  float effectLevel;
+  if (effectStep(effectLevel) != effect_idle) {
 #ifdef DIMMER_WITHOUT_LEVEL
-  switchLevel(true);
-  delay(100);
-  switchLevel(false);
-  delay(100);
-  switchLevel(true);
-  delay(100);
-  switchLevel(false);
-  delay(100);
+    switchLevel(effectLevel > 0);
 #else
 #ifdef ESP32
-  ledcWrite(channel, 128);
-  delay(100);
-  ledcWrite(channel, 0);
-  delay(100);
-  ledcWrite(channel, 128);
-  delay(100);
-  ledcWrite(channel, 0);
-  delay(100);
+    ledcWrite(channel, int(255*effectLevel));
 #else
-  analogWrite(pin, 128);
-  delay(100);
-  analogWrite(pin, 0);
-  delay(100);
-  analogWrite(pin, 128);
-  delay(100);
-  analogWrite(pin, 0);
-  delay(100);
+    analogWrite(pin, int(255*effectLevel));
 #endif
 #endif
-  updateDimmer();
-}
-
-void PWMDimmer::loop() {
+    return;
+  }
   // Quick return if we have nothing to do
 #ifdef DIMMER_WITHOUT_LEVEL
   if (isOn) {
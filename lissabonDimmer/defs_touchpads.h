@@ -8,11 +8,15 @@
 #define WITH_TOUCHPADS
 // Uses a user interface in the first place
 #define WITH_UI
+// Touch sensor wakes us from sleep, so a long sleepDuration doesn't lose taps
+#define WITH_TOUCH_WAKE
 
 #include "iotsaInput.h"
 // Two touchpad pins: off/decrement (long press), on/increment (long press)
-Touchpad touchdown(2, true, true, true);
-Touchpad touchup(13, true, true, true);
+#define PIN_TOUCH_DOWN 2
+#define PIN_TOUCH_UP 13
+Touchpad touchdown(PIN_TOUCH_DOWN, true, true, true);
+Touchpad touchup(PIN_TOUCH_UP, true, true, true);
 UpDownButtons encoder(touchdown, touchup, true);
 
 Input* inputs[] = {
@@ -18,6 +18,7 @@
 #define TAP_DURATION 1000
 
 #define WITH_OTA    // Enable Over The Air updates from ArduinoIDE. Needs at least 1MB flash.
+#define WITH_USAGE_SCHEDULE // Sleep shorter in hours the dimmer is used, longer when it isn't.
 
 IotsaApplication application("Lissabon Dimmer");
 IotsaWifiMod wifiMod(application);
@@ -38,7 +39,12 @@ IotsaBLEServerMod bleserverMod(application);
 #define PIN_DISABLESLEEP 0
 //#define PIN_VBAT 37
 //#define VBAT_100_PERCENT (12.0/11.0) // 100K and 1M resistors divide by 11, not 10...
+#ifdef WITH_USAGE_SCHEDULE
+#include "UsageSchedule.h"
+Lissabon::ScheduledBatteryMod batteryMod(application);
+#else
 IotsaBatteryMod batteryMod(application);
+#endif
 
 #include "iotsaInput.h"
 
@@ -49,6 +55,9 @@ IotsaInputMod inputMod(application, inputs, sizeof(inputs)/sizeof(inputs[0]));
 #endif
 
 #include "DimmerBLEServer.h"
+#ifdef WITH_TOUCH_WAKE
+#include "TouchWake.h"
+#endif
 
 using namespace Lissabon;
 
@@ -71,6 +80,9 @@ public:
 #endif
 #endif
     dimmerBLEServer(dimmer)
+#ifdef WITH_USAGE_SCHEDULE
+    , usageSchedule(dimmer)
+#endif
   {
   }
   void setup();
@@ -84,6 +96,9 @@ protected:
   void dimmerOnOffChanged() override;
   void dimmerValueChanged() override;
   void dimmerAvailableChanged() override {};
+#ifdef WITH_TOUCH_WAKE
+  void sleepWakeupNotification(bool sleep) override;
+#endif
   void handler();
   bool getHandler(const char *path, JsonObject& reply);
   bool putHandler(const char *path, const JsonVariant& request, JsonObject& reply);
@@ -100,6 +115,12 @@ private:
 #endif
 #endif
   DimmerBLEServer dimmerBLEServer;
+#ifdef WITH_TOUCH_WAKE
+  TouchWake touchWake;
+#endif
+#ifdef WITH_USAGE_SCHEDULE
+  UsageSchedule usageSchedule;
+#endif
   uint32_t saveAtMillis = 0;
   uint32_t lastButtonChangeMillis = 0;
   int buttonChangeCount = 0;
@@ -182,9 +203,19 @@ String LissabonDimmerMod::info() {
 
 bool LissabonDimmerMod::getHandler(const char *path, JsonObject& reply) {
   dimmer.getHandler(reply);
+  JsonObject bleReply = reply["ble"].to<JsonObject>();
+  dimmerBLEServer.getHandler(bleReply);
 #ifdef WITH_DOUBLE_DIMMER
   JsonObject dimmer2Reply = reply["dimmer2"].to<JsonObject>();
   dimmer2.getHandler(dimmer2Reply);
+#endif
+#ifdef WITH_TOUCH_WAKE
+  JsonObject touchWakeReply = reply["touchWake"].to<JsonObject>();
+  touchWake.getHandler(touchWakeReply);
+#endif
+#ifdef WITH_USAGE_SCHEDULE
+  JsonObject scheduleReply = reply["schedule"].to<JsonObject>();
+  usageSchedule.getHandler(scheduleReply);
 #endif
   return true;
 }
@@ -196,6 +227,10 @@ bool LissabonDimmerMod::putHandler(const char *path, const JsonVariant& request,
   if (!reqObj) return false;
   if (dimmer.putHandler(reqObj)) anyChanged = dimmerChanged = true;
   if (dimmerChanged) dimmer.updateDimmer(); // xxxjack or is this called already?
+#ifdef WITH_USAGE_SCHEDULE
+  JsonVariant scheduleRequest = reqObj["schedule"];
+  if (scheduleRequest && usageSchedule.putHandler(scheduleRequest)) anyChanged = true;
+#endif
 #ifdef WITH_DOUBLE_DIMMER
   bool dimmer2Changed = false;
   JsonVariant dimmer2Request = reqObj["dimmer2"];
@@ -226,6 +261,9 @@ void LissabonDimmerMod::serverSetup() {
 void LissabonDimmerMod::configLoad() {
   IotsaConfigFileLoad cf("/config/pwmdimmer.cfg");
   dimmer.configLoad(cf, "dimmer");
+#ifdef WITH_USAGE_SCHEDULE
+  usageSchedule.configLoad(cf, "schedule");
+#endif
 #ifdef TOGGLE_ONOFF_ON_REBOOT
   // Save the toggled on/off state
   dimmer.isOn = !dimmer.isOn;
@@ -240,6 +278,9 @@ void LissabonDimmerMod::configLoad() {
 void LissabonDimmerMod::configSave() {
   IotsaConfigFileSave cf("/config/pwmdimmer.cfg");
   dimmer.configSave(cf, "dimmer");
+#ifdef WITH_USAGE_SCHEDULE
+  usageSchedule.configSave(cf, "schedule");
+#endif
 #ifdef WITH_DOUBLE_DIMMER
   dimmer2.configSave(cf, "dimmer2");
 #endif
@@ -256,11 +297,18 @@ void LissabonDimmerMod::setup() {
 #endif
 #ifdef PIN_DISABLESLEEP
   batteryMod.setPinDisableSleep(PIN_DISABLESLEEP);
+#endif
+#ifdef WITH_USAGE_SCHEDULE
+  batteryMod.setSchedule(&usageSchedule);
 #endif
   configLoad();
 #if defined(WITH_TOUCHPADS)
   iotsaConfig.allowRCMDescription("tap any touchpad 4 times");
   dimmerUI.setUpDownButtons(encoder);
+#ifdef WITH_TOUCH_WAKE
+  touchWake.addPad(PIN_TOUCH_DOWN, std::bind(&DimmerUI::tapUpDown, &dimmerUI, false));
+  touchWake.addPad(PIN_TOUCH_UP, std::bind(&DimmerUI::tapUpDown, &dimmerUI, true));
+#endif
 #elif defined(WITH_BUTTONS)
   iotsaConfig.allowRCMDescription("press button 4 times");
   dimmerUI.setUpDownButtons(encoder);
@@ -290,12 +338,26 @@ void LissabonDimmerMod::loop() {
     saveAtMillis = 0;
     configSave();
   }
+  dimmerBLEServer.loop();
   dimmer.loop();
+#ifdef WITH_USAGE_SCHEDULE
+  usageSchedule.loop();
+#endif
 #ifdef WITH_DOUBLE_DIMMER
   dimmer2.loop();
 #endif
 }
 
+#ifdef WITH_TOUCH_WAKE
+void LissabonDimmerMod::sleepWakeupNotification(bool sleep) {
+  if (sleep) {
+    touchWake.sleep();
+  } else {
+    touchWake.wakeup();
+  }
+}
+#endif
+
 void LissabonDimmerMod::dimmerValueChanged() {
   iotsaConfig.postponeSleep(2000);
   saveAtMillis = millis() + 1000;
@@ -9,6 +9,13 @@ const float SQRT_HALF = sqrt(0.5);
 // Calculating the curve every loop is more cpu-intensitive but animations look much better.
 #define LEDSTRIP_CALCULATE_LEVELS_EVERY_LOOP
 
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+// Core for the render task. The Arduino loop runs on core 1.
+#ifndef LEDSTRIP_RENDER_CORE
+#define LEDSTRIP_RENDER_CORE 0
+#endif
+#endif
+
 namespace Lissabon {
 
 LedstripDimmer::LedstripDimmer(int _num, IotsaPixelstripMod& _mod, DimmerCallbacks *_callbacks)
@@ -28,10 +35,13 @@ void LedstripDimmer::updateDimmer() {
 #ifndef LEDSTRIP_CALCULATE_LEVELS_EVERY_LOOP
   // xxxjack calling calcPixelLevels here (in stead of in loop) means the curve
   // remains the same during fades. Calling it in loop() would fix that.
-  calcPixelLevels(level);
+  calcPixelLevels(level, focalPoint, focalSpread);
 #endif
   // Compute animation duration, which signals to loop() that things neeed to change.
   AbstractDimmer::updateDimmer();
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  renderTargetDirty = true;
+#endif
 }
 
 void LedstripDimmer::clampLevel() {
@@ -44,13 +54,13 @@ void LedstripDimmer::clampLevel() {
 #endif
 }
 
-void LedstripDimmer::calcPixelLevels(float wantedLevel) {
+void LedstripDimmer::calcPixelLevels(float wantedLevel, float _focalPoint, float _focalSpread) {
  
   //
   // Determine how much light we can produce with the preferred curve
   //
-  float cumulativeValue = levelFuncCumulative(0, count, 1);
-  DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.calcPixelLevels: wantedLevel=%f focalSpread=%f focalPoint=%f cumulativeValue=%f\n", wantedLevel, focalSpread, focalPoint, cumulativeValue);
+  float cumulativeValue = levelFuncCumulative(0, count, 1, _focalPoint, _focalSpread);
+  DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.calcPixelLevels: wantedLevel=%f focalSpread=%f focalPoint=%f cumulativeValue=%f\n", wantedLevel, _focalSpread, _focalPoint, cumulativeValue);
   //
   // We may need to increase spread, because the current curve may result in brightness > 1 for some
   // pixels.
@@ -59,12 +69,12 @@ void LedstripDimmer::calcPixelLevels(float wantedLevel) {
   float correction = count / cumulativeValue;
   if (pixelLevels != NULL) {
     for(int i=0; i<count; i++) {
-      float thisValue = levelFuncCumulative(i, i+1, 1) * correction;
+      float thisValue = levelFuncCumulative(i, i+1, 1, _focalPoint, _focalSpread) * correction;
       DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.calcPixelLevels: uncorrected pixelLevel[%d] = %f\n", i, thisValue);
       if (thisValue*wantedLevel > spreadCorrection) spreadCorrection = thisValue*wantedLevel;
     }
   }
-  cumulativeValue = levelFuncCumulative(0, count, spreadCorrection);
+  cumulativeValue = levelFuncCumulative(0, count, spreadCorrection, _focalPoint, _focalSpread);
   DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.calcPixelLevels: spreadCorrection=%f cumulativeValue=%f\n", spreadCorrection, cumulativeValue);
   //
   // cumulativeValue is the amount of light produced. We need to
@@ -77,7 +87,7 @@ void LedstripDimmer::calcPixelLevels(float wantedLevel) {
   float sumLevel = 0;
   if (pixelLevels != NULL) {
     for(int i=0; i<count; i++) {
-      float thisValue = levelFuncCumulative(i, i+1, spreadCorrection) * correction;
+      float thisValue = levelFuncCumulative(i, i+1, spreadCorrection, _focalPoint, _focalSpread) * correction;
       pixelLevels[i] = thisValue;
       DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.calcPixelLevels: pixelLevel[%d] = %f\n", i, thisValue);
       sumLevel += thisValue;
@@ -116,15 +126,15 @@ String LedstripDimmer::colorDump() {
   return rv;
 }
 
-float LedstripDimmer::levelFuncCumulative(int left, int right, float spreadFactor) {
+float LedstripDimmer::levelFuncCumulative(int left, int right, float spreadFactor, float _focalPoint, float _focalSpread) {
   // Cumulative light function. left and right are 0..1 values.
   // We assume a range of -8..8 is "close enough" that erf(8)-erf(-8) is 2.
   float leftFraction = (float)left / count;
   float rightFraction = (float) right / count;
-  float range  = (1 - focalSpread)/spreadFactor;
+  float range  = (1 - _focalSpread)/spreadFactor;
   if (range <= 0) range = 0.001;
-  float leftEdge = (0-focalPoint*16) * range;
-  float rightEdge =(16-focalPoint*16) * range;
+  float leftEdge = (0-_focalPoint*16) * range;
+  float rightEdge =(16-_focalPoint*16) * range;
   float leftScaled = leftEdge + leftFraction * (rightEdge-leftEdge);
   float rightScaled = leftEdge + rightFraction * (rightEdge-leftEdge);
   float erfLeft = erf(leftScaled);
@@ -158,6 +168,18 @@ void LedstripDimmer::getHandler(JsonObject& reply) {
     reply["ccLevel_b"] = correctRgbwColor.B;
     reply["ccLevel_w"] = correctRgbwColor.W;
   }
+  JsonObject renderReply = reply["render"].to<JsonObject>();
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  renderReply["task"] = renderTaskHandle != nullptr;
+#else
+  renderReply["task"] = false;
+#endif
+  renderReply["frames"] = renderFrames;
+  if (renderFrames) {
+    renderReply["avgFrameMicros"] = renderTotalMicros / renderFrames;
+    renderReply["maxFrameMicros"] = renderMaxMicros;
+  }
+  renderReply["maxLoopIntervalMicros"] = maxLoopIntervalMicros;
   AbstractDimmer::getHandler(reply);
 }
 
@@ -195,6 +217,9 @@ bool LedstripDimmer::putHandler(const JsonVariant& request) {
     }
     updateColorspace(whiteTemperature, whiteBrightness);
   }
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  renderTargetDirty = true;
+#endif
   return true;
 }
 
@@ -271,55 +296,94 @@ void LedstripDimmer::formHandler_TD(String& message, bool includeConfig) {
 
 }
 
-void LedstripDimmer::identify() {
-  if (!pixelBuffer) return;
-  memset(pixelBuffer, 255, count*bpp);
-  stripHandler->pixelSourceCallback();
-  delay(100);
-  memset(pixelBuffer, 0, count*bpp);
-  stripHandler->pixelSourceCallback();
-  delay(100);
-  memset(pixelBuffer, 255, count*bpp);
-  stripHandler->pixelSourceCallback();
-  delay(100);
-  memset(pixelBuffer, 0, count*bpp);
+void LedstripDimmer::_showEffect(float effectLevel) {
+  // All channels of all pixels, no color correction: effects should be noticed, not pretty.
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  xSemaphoreTakeRecursive(renderLock, portMAX_DELAY);
+#endif
+  memset(pixelBuffer, int(255*effectLevel), count*bpp);
   stripHandler->pixelSourceCallback();
-  delay(100);
-  updateDimmer();
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  xSemaphoreGiveRecursive(renderLock);
+#endif
+}
+
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+void LedstripDimmer::lockPixels() {
+  if (renderLock == nullptr) renderLock = xSemaphoreCreateRecursiveMutex();
+  xSemaphoreTakeRecursive(renderLock, portMAX_DELAY);
+}
+
+void LedstripDimmer::unlockPixels() {
+  xSemaphoreGiveRecursive(renderLock);
+}
+#endif
+
+void LedstripDimmer::effectFinished() {
+  AbstractDimmer::effectFinished();
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  // The render task has to redraw the current state.
+  renderTargetDirty = true;
+#endif
 }
 
 
 void LedstripDimmer::setHandler(uint8_t *_buffer, size_t _count, int _bpp, IotsaPixelsourceHandler *_handler) {
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  // The render task may be drawing into the old buffers.
+  if (renderLock == nullptr) renderLock = xSemaphoreCreateRecursiveMutex();
+  xSemaphoreTakeRecursive(renderLock, portMAX_DELAY);
+#endif
   pixelBuffer = _buffer;
   count = _count;
   bpp = _bpp;
   if (pixelLevels != NULL) free(pixelLevels);
   pixelLevels = (float *)calloc(count, sizeof(float));
   stripHandler = _handler;
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  xSemaphoreGiveRecursive(renderLock);
+  if (renderTaskHandle == nullptr) {
+    xTaskCreatePinnedToCore(LedstripDimmer::_renderTaskEntry, "LedstripRender", 4096, this, 1, &renderTaskHandle, LEDSTRIP_RENDER_CORE);
+  }
+#endif
   updateDimmer();
 }
 
-void LedstripDimmer::loop() {
-  unsigned long loopStart = micros();
-  // If we are not completely setup we return.
-  if (pixelBuffer == NULL || count == 0 || stripHandler == NULL) return;
-  // Quick return if we have nothing to do
-  if (animationStartMillis == 0 || animationEndMillis == 0) return;
-  //
-  // If we are in calibration mode we simply set the pixels and be done
-  //
-  if (inCalibrationMode) {
-    IotsaSerial.printf("Loop: calibration r1 %f g2 %f b1 %f w1 %f, r1 %f g2 %f b1 %f w1 %f\n", 
-      calibrationData[0], calibrationData[1], calibrationData[2], calibrationData[3],
-      calibrationData[4], calibrationData[5], calibrationData[6], calibrationData[7]
-    );
-    uint8_t *p = pixelBuffer;
+LedstripDimmer::RenderTarget LedstripDimmer::_renderTarget() {
+  RenderTarget target;
+  target.wantedLevel = isOn ? level : 0;
+#ifdef DIMMER_WITH_ANIMATION
+  target.prevLevel = animationPrevLevel;
+  target.animationStartMillis = animationStartMillis;
+  target.animationEndMillis = animationEndMillis;
+#else
+  target.prevLevel = target.wantedLevel;
+  target.animationStartMillis = target.animationEndMillis = 0;
+#endif
+  target.temperature = temperature;
+  target.focalPoint = focalPoint;
+  target.focalSpread = focalSpread;
+  target.whiteTemperature = rgbwSpace.WTemperature;
+  target.whiteBrightness = rgbwSpace.WBrightness;
+  target.doGamma = gamma > 1.1;
+  target.inCalibrationMode = inCalibrationMode;
+  memcpy(target.calibrationData, calibrationData, sizeof(calibrationData));
+  return target;
+}
+
+void LedstripDimmer::_renderFrame(const RenderTarget& target, float frameLevel, Colorspace& space) {
+  uint32_t frameStart = micros();
+  uint8_t *p = pixelBuffer;
+  if (target.inCalibrationMode) {
+    //
+    // In calibration mode we simply set the pixels and be done
+    //
     for (int i=0; i<count; i++) {
       RgbwFColor thisPixelFColor;
       if (i&1) {
-        thisPixelFColor = RgbwFColor(calibrationData[4], calibrationData[5], calibrationData[6], calibrationData[7]);
+        thisPixelFColor = RgbwFColor(target.calibrationData[4], target.calibrationData[5], target.calibrationData[6], target.calibrationData[7]);
       } else {
-        thisPixelFColor = RgbwFColor(calibrationData[0], calibrationData[1], calibrationData[2], calibrationData[3]);
+        thisPixelFColor = RgbwFColor(target.calibrationData[0], target.calibrationData[1], target.calibrationData[2], target.calibrationData[3]);
       }
       RgbwColor thisPixelColor = thisPixelFColor;
       *p++ = thisPixelColor.R;
@@ -327,7 +391,112 @@ void LedstripDimmer::loop() {
       *p++ = thisPixelColor.B;
       if (bpp == 4) *p++ = thisPixelColor.W;
     }
-    stripHandler->pixelSourceCallback();
+  } else {
+#ifdef LEDSTRIP_CALCULATE_LEVELS_EVERY_LOOP
+    calcPixelLevels(frameLevel, target.focalPoint, target.focalSpread);
+#endif
+    for (int i=0; i<count; i++) {
+      float thisLevel = frameLevel*pixelLevels[i];
+      if (thisLevel > 1) thisLevel = 1;
+      TempFColor thisTFColor(target.temperature, thisLevel);
+      RgbwFColor thisPixelFColor = space.toRgbw(thisTFColor);
+      RgbwColor thisPixelColor = thisPixelFColor;
+      DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.loop: pixel %d: level=%f r=%d g=%d b=%d w=%d\n", i, thisLevel, thisPixelColor.R, thisPixelColor.G, thisPixelColor.B, thisPixelColor.W);
+      *p++ = thisPixelColor.R;
+      *p++ = thisPixelColor.G;
+      *p++ = thisPixelColor.B;
+      if (bpp == 4) *p++ = thisPixelColor.W;
+    }
+  }
+  stripHandler->pixelSourceCallback();
+  uint32_t frameMicros = micros() - frameStart;
+  renderFrames++;
+  renderTotalMicros += frameMicros;
+  if (frameMicros > renderMaxMicros) renderMaxMicros = frameMicros;
+  DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer: frame %u us\n", frameMicros);
+}
+
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+void LedstripDimmer::_renderTaskEntry(void *arg) {
+  LedstripDimmer *_this = reinterpret_cast<LedstripDimmer *>(arg);
+  _this->renderTask();
+}
+
+void LedstripDimmer::renderTask() {
+  IotsaSerial.printf("LedstripDimmer: render task on core %d\n", xPortGetCoreID());
+  // Our own copy of the colorspace, rebuilt only when the white LED parameters change.
+  Colorspace space = rgbwSpace;
+  float spaceTemperature = -1;
+  float spaceBrightness = -1;
+  bool spaceGamma = false;
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    TickType_t lastWake = xTaskGetTickCount();
+    bool done = false;
+    while (!done) {
+      // Read the mailbox every frame, so a new target during a fade is picked up immediately.
+      RenderTarget target = renderMailbox.read();
+      if (target.whiteTemperature != spaceTemperature || target.whiteBrightness != spaceBrightness || target.doGamma != spaceGamma) {
+        spaceTemperature = target.whiteTemperature;
+        spaceBrightness = target.whiteBrightness;
+        spaceGamma = target.doGamma;
+        space = Colorspace(spaceTemperature, spaceBrightness, true, spaceGamma);
+      }
+      float frameLevel = target.wantedLevel;
+      done = true;
+      if (!target.inCalibrationMode && target.animationStartMillis != 0 && target.animationEndMillis != 0) {
+        // Same computation as calcCurLevel(), but on our own copy.
+        uint32_t thisDur = target.animationEndMillis - target.animationStartMillis;
+        if (thisDur == 0) thisDur = 1;
+        float progress = float(millis() - target.animationStartMillis) / float(thisDur);
+        if (progress < 0) progress = 0;
+        if (progress < 1) {
+          frameLevel = target.wantedLevel*progress + target.prevLevel*(1-progress);
+          done = false;
+        }
+      }
+      xSemaphoreTakeRecursive(renderLock, portMAX_DELAY);
+      // While an effect is shown the main loop owns the pixels. The fade
+      // continues underneath, and we redraw when it has finished.
+      if (pixelBuffer != NULL && count != 0 && stripHandler != NULL && !effectActive()) {
+        _renderFrame(target, frameLevel, space);
+      }
+      xSemaphoreGiveRecursive(renderLock);
+      if (!done) vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(frameIntervalMillis));
+    }
+  }
+}
+#endif // LEDSTRIP_WITH_RENDER_TASK
+
+void LedstripDimmer::loop() {
+  uint32_t loopStart = micros();
+  if (lastLoopMicros != 0 && loopStart - lastLoopMicros > maxLoopIntervalMicros) {
+    maxLoopIntervalMicros = loopStart - lastLoopMicros;
+  }
+  lastLoopMicros = loopStart;
+  // If we are not completely setup we return.
+  if (pixelBuffer == NULL || count == 0 || stripHandler == NULL) return;
+  float effectLevel;
+  EffectState effectState = effectStep(effectLevel);
+  if (effectState == effect_changed) _showEffect(effectLevel);
+  if (effectState != effect_idle) return;
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  if (renderTargetDirty) {
+    renderTargetDirty = false;
+    renderMailbox.write(_renderTarget());
+    if (renderTaskHandle) xTaskNotifyGive(renderTaskHandle);
+  }
+#endif
+  // Quick return if we have nothing to do
+  if (animationStartMillis == 0 || animationEndMillis == 0) return;
+  if (inCalibrationMode) {
+    IotsaSerial.printf("Loop: calibration r1 %f g2 %f b1 %f w1 %f, r1 %f g2 %f b1 %f w1 %f\n", 
+      calibrationData[0], calibrationData[1], calibrationData[2], calibrationData[3],
+      calibrationData[4], calibrationData[5], calibrationData[6], calibrationData[7]
+    );
+#ifndef LEDSTRIP_WITH_RENDER_TASK
+    _renderFrame(_renderTarget(), 0, rgbwSpace);
+#endif
     animationStartMillis = animationEndMillis = 0;
     return;
   }
@@ -335,26 +504,11 @@ void LedstripDimmer::loop() {
   // Compute current level (taking into account isOn and animation progress)
   //
   calcCurLevel();
-#ifdef LEDSTRIP_CALCULATE_LEVELS_EVERY_LOOP
-  calcPixelLevels(curLevel);
+#ifndef LEDSTRIP_WITH_RENDER_TASK
+  _renderFrame(_renderTarget(), curLevel, rgbwSpace);
 #endif
-  
-  uint8_t *p = pixelBuffer;
-  
-  for (int i=0; i<count; i++) {
-    float thisLevel = curLevel*pixelLevels[i];
-    if (thisLevel > 1) thisLevel = 1;
-    TempFColor thisTFColor(temperature, thisLevel);
-    RgbwFColor thisPixelFColor = rgbwSpace.toRgbw(thisTFColor);
-    RgbwColor thisPixelColor = thisPixelFColor;
-    DEBUG_LEDSTRIP IotsaSerial.printf("LedstripDimmer.loop: pixel %d: level=%f r=%d g=%d b=%d w=%d\n", i, thisLevel, thisPixelColor.R, thisPixelColor.G, thisPixelColor.B, thisPixelColor.W);
-    *p++ = thisPixelColor.R;
-    *p++ = thisPixelColor.G;
-    *p++ = thisPixelColor.B;
-    if (bpp == 4) *p++ = thisPixelColor.W;
-  }
-  stripHandler->pixelSourceCallback();
-  IotsaSerial.printf("LedstripDimmer.loop: %lu us\n", micros()-loopStart);
+  // With a render task we only keep the animation state (and the callbacks) up to date,
+  // the task draws the frames.
 }
 
-}
\ No newline at end of file
+}
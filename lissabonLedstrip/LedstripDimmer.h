@@ -5,6 +5,9 @@
 #include "iotsaPixelstrip.h"
 
 #include "NPBColorLib.h"
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+#include "Seqlock.h"
+#endif
 
 namespace Lissabon {
 
@@ -14,7 +17,6 @@ public:
   void setup();
   virtual void updateDimmer() override;
   bool available() override;
-  void identify();
   void loop();
   // Overrides
   virtual void getHandler(JsonObject& reply) override;
@@ -26,6 +28,11 @@ public:
   virtual void formHandler_TD(String& message, bool includeConfig);
 
   void setHandler(uint8_t *_buffer, size_t _count, int bpp, IotsaPixelsourceHandler *handler);
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  // So the pixelstrip module's own writes (clear, set pixel, new count) don't race the render task.
+  void lockPixels() override;
+  void unlockPixels() override;
+#endif
   virtual float applyGamma(float level) override { return level; };
 protected:
   IotsaPixelstripMod& mod;
@@ -35,9 +42,29 @@ protected:
   float *pixelLevels = NULL; // per-pixel relative intensities
   IotsaPixelsourceHandler *stripHandler;
 
+  virtual void effectFinished() override;
+  void _showEffect(float effectLevel);
   void updateColorspace(float whiteTemperature, float whiteBrightness);
   void clampLevel();
-  void calcPixelLevels(float wantedLevel);
+  // Everything needed to render a frame. Owned by the main loop, handed to
+  // the render task (if there is one) as a whole.
+  struct RenderTarget {
+    float wantedLevel;  // level, or 0 if off
+    float prevLevel;    // level at animation start
+    uint32_t animationStartMillis;
+    uint32_t animationEndMillis;
+    float temperature;
+    float focalPoint;
+    float focalSpread;
+    float whiteTemperature;
+    float whiteBrightness;
+    bool doGamma;
+    bool inCalibrationMode;
+    float calibrationData[8];
+  };
+  RenderTarget _renderTarget();
+  void _renderFrame(const RenderTarget& target, float frameLevel, Colorspace& space);
+  void calcPixelLevels(float wantedLevel, float _focalPoint, float _focalSpread);
   float maxLevelCorrectColor();
   String colorDump();
   Colorspace rgbwSpace;
@@ -46,7 +73,28 @@ protected:
   
   float focalPoint;  // Where the focus of the light is (0.0 .. 1.0)
   float focalSpread;  // How wide the focus is (0.0 .. 1.0)
-  float levelFuncCumulative(int left, int right, float spreadFactor); // Cumulative level between pixels [left, right)
+  float levelFuncCumulative(int left, int right, float spreadFactor, float _focalPoint, float _focalSpread); // Cumulative level between pixels [left, right)
+#ifdef LEDSTRIP_WITH_RENDER_TASK
+  // Frames are computed and shown by a task on the other core, so fades on
+  // long strips don't hold up the web server, BLE and touch handling.
+  static void _renderTaskEntry(void *arg);
+  void renderTask();
+  TaskHandle_t renderTaskHandle = nullptr;
+  // Held by the render task while it draws a frame, by setHandler() while
+  // it replaces the buffers, and by the pixelstrip module through
+  // lockPixels(). Recursive, because the module calls setHandler() with it held.
+  SemaphoreHandle_t renderLock = nullptr;
+  Seqlock<RenderTarget> renderMailbox;
+  bool renderTargetDirty = false;
+  const uint32_t frameIntervalMillis = 10;
+#endif
+  // Frame timing (in the render task if there is one), reported by getHandler().
+  uint32_t renderFrames = 0;
+  uint32_t renderTotalMicros = 0;
+  uint32_t renderMaxMicros = 0;
+  // Main loop timing: time between calls to loop().
+  uint32_t lastLoopMicros = 0;
+  uint32_t maxLoopIntervalMicros = 0;
 };
 };
 #endif // _LEDSTRIPDIMMER_H_
\ No newline at end of file
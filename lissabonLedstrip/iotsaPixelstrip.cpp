@@ -15,30 +15,41 @@ IotsaPixelstripMod::handler() {
     // Note: this sets the value for a single LED, not the value for a single NeoPixel (3/4 leds)
     int idx = server->arg("setIndex").toInt();
     int val = server->arg("setValue").toInt();
+    _lockPixels();
     if (pixelBuffer && idx >= 0 && idx <= count*IOTSA_NPB_BPP) {
       pixelBuffer[idx] = val;
       pixelSourceCallback();
     }
+    _unlockPixels();
   } else if (server->hasArg("clear")) {
+    _lockPixels();
     if (pixelBuffer) {
       memset(pixelBuffer, 0, count*IOTSA_NPB_BPP);
       pixelSourceCallback();
     }
+    _unlockPixels();
   } else {
     bool anyChanged = false;
+    int newPin = pin;
+    int newCount = count;
     if( server->hasArg("pin")) {
       if (needsAuthentication()) return;
-      pin = server->arg("pin").toInt();
+      newPin = server->arg("pin").toInt();
       anyChanged = true;
     }
     if( server->hasArg("count")) {
       if (needsAuthentication()) return;
-      count = server->arg("count").toInt();
+      newCount = server->arg("count").toInt();
       anyChanged = true;
     }
     if (anyChanged) {
+      // The source may be showing pixels with the old count and buffer.
+      _lockPixels();
+      pin = newPin;
+      count = newCount;
       configSave();
       setupStrip();
+      _unlockPixels();
     }
   }
 
@@ -62,7 +73,9 @@ String IotsaPixelstripMod::info() {
 
 void IotsaPixelstripMod::setup() {
   configLoad();
+  _lockPixels();
   setupStrip();
+  _unlockPixels();
 }
 
 void IotsaPixelstripMod::setupStrip() {
@@ -149,11 +162,13 @@ bool IotsaPixelstripMod::getHandler(const char *path, JsonObject& reply) {
     return true;
   } else if (strcmp(path, "/api/pixels") == 0) {
     JsonArray data = reply["data"].to<JsonArray>();
+    _lockPixels();
     if (pixelBuffer) {
       for(int i=0; i<count*IOTSA_NPB_BPP; i++) {
         data.add(pixelBuffer[i]);
       }
     }
+    _unlockPixels();
     return true;
   }
   return false;
@@ -163,20 +178,31 @@ bool IotsaPixelstripMod::putHandler(const char *path, const JsonVariant& request
     JsonObject reqObj = request.as<JsonObject>();
   if (strcmp(path, "/api/pixelstrip") == 0) {
     bool anyChanged = false;
-    if (getFromRequest<int>(reqObj, "pin", pin)) anyChanged = true;
-    if (getFromRequest<int>(reqObj, "count", count)) anyChanged = true;
-    if (count < 2) {
+    int newPin = pin;
+    int newCount = count;
+    if (getFromRequest<int>(reqObj, "pin", newPin)) anyChanged = true;
+    if (getFromRequest<int>(reqObj, "count", newCount)) anyChanged = true;
+    if (newCount < 2) {
       IotsaSerial.println("count set to 2 to workaround bug");
-      count = 2;
+      newCount = 2;
     }
     checkUnhandled(reqObj);
     if (anyChanged) {
+      // The source may be showing pixels with the old count and buffer.
+      _lockPixels();
+      pin = newPin;
+      count = newCount;
       configSave();
       setupStrip();
+      _unlockPixels();
     }
     return anyChanged;
   } else if (strcmp(path, "/api/pixels") == 0) {
-    if (pixelBuffer == NULL) return false;
+    _lockPixels();
+    if (pixelBuffer == NULL) {
+      _unlockPixels();
+      return false;
+    }
     bool clear;
     if (getFromRequest<bool>(reqObj, "clear", clear) && clear) {
       memset(pixelBuffer, 0, count*IOTSA_NPB_BPP);
@@ -184,13 +210,18 @@ bool IotsaPixelstripMod::putHandler(const char *path, const JsonVariant& request
     int start = 0;
     (void)getFromRequest<int>(reqObj, "start", start);
     JsonArray data = reqObj["data"];
+    bool ok = true;
     for(JsonArray::iterator it=data.begin(); it!=data.end(); ++it) {
-      if (start >= count*IOTSA_NPB_BPP) return false;
+      if (start >= count*IOTSA_NPB_BPP) {
+        ok = false;
+        break;
+      }
       int value = it->as<int>();
       pixelBuffer[start++] = value;
     }
-    pixelSourceCallback();
-    return true;
+    if (ok) pixelSourceCallback();
+    _unlockPixels();
+    return ok;
   }
   return false;
 }
@@ -54,7 +54,11 @@ class IotsaPixelsource {
 public:
   virtual ~IotsaPixelsource() {}
   virtual void setHandler(uint8_t *_buffer, size_t _count, int bpp, IotsaPixelsourceHandler *handler) = 0;
-
+  // Held by the pixelstrip module while it uses or changes the buffer (or
+  // the strip) on its own, for a source that draws from another task.
+  // Must allow setHandler() to be called while it is held.
+  virtual void lockPixels() {}
+  virtual void unlockPixels() {}
 };
 
 class IotsaPixelstripMod : public IotsaPixelstripModBaseMod, public IotsaPixelsourceHandler {
@@ -80,6 +84,8 @@ protected:
   void configSave();
   void setupStrip();
   void handler();
+  void _lockPixels() { if (source) source->lockPixels(); }
+  void _unlockPixels() { if (source) source->unlockPixels(); }
   IotsaPixelsource *source;
   IotsaNeoPixelBus *strip;
   uint8_t *pixelBuffer;
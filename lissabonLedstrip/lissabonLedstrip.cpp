@@ -24,8 +24,13 @@
 // Enable Over The Air updates from ArduinoIDE. Needs at least 1MB flash.
 #define WITH_OTA
 
+// Define this to sleep shorter in hours the ledstrip is used, longer when it isn't.
+#define WITH_USAGE_SCHEDULE
+
 // Define this to enable support for touchpads to control the led strip (otherwise only BLE/REST/WEB control)
 #define WITH_TOUCHPADS
+// Define this to have the touch sensor wake us from sleep, so a long sleepDuration doesn't lose taps
+#define WITH_TOUCH_WAKE
 
 IotsaApplication application("Lissabon LEDstrip");
 IotsaWifiMod wifiMod(application);
@@ -47,7 +52,12 @@ IotsaBLEServerMod bleserverMod(application);
 #define PIN_VBAT 35
 #define VBAT_100_PERCENT (12.7/10.0) // 100K and 1M resistors divide by 11, not 10...
 #define VBAT_0_PERCENT (10.5/10.0) // 100K and 1M resistors divide by 11, not 10...
+#ifdef WITH_USAGE_SCHEDULE
+#include "UsageSchedule.h"
+Lissabon::ScheduledBatteryMod batteryMod(application);
+#else
 IotsaBatteryMod batteryMod(application);
+#endif
 
 #include "iotsaPixelstrip.h"
 IotsaPixelstripMod pixelstripMod(application);
@@ -55,11 +65,15 @@ IotsaPixelstripMod pixelstripMod(application);
 
 #ifdef WITH_TOUCHPADS
 #include "iotsaInput.h"
-Touchpad upTouch(32, true, true, true);
-Touchpad downTouch(13, true, true, true);
+#define PIN_TOUCH_UP 32
+#define PIN_TOUCH_DOWN 13
+#define PIN_TOUCH_UPTEMP 14
+#define PIN_TOUCH_DOWNTEMP 15
+Touchpad upTouch(PIN_TOUCH_UP, true, true, true);
+Touchpad downTouch(PIN_TOUCH_DOWN, true, true, true);
 UpDownButtons levelEncoder(upTouch, downTouch, true);
-Touchpad upTempTouch(14, true, true, true);
-Touchpad downTempTouch(15, true, true, true);
+Touchpad upTempTouch(PIN_TOUCH_UPTEMP, true, true, true);
+Touchpad downTempTouch(PIN_TOUCH_DOWNTEMP, true, true, true);
 UpDownButtons temperatureEncoder(upTempTouch, downTempTouch, false);
 //Touchpad(15, true, false, true);
 
@@ -69,9 +83,14 @@ Input* inputs[] = {
 };
 
 IotsaInputMod inputMod(application, inputs, sizeof(inputs)/sizeof(inputs[0]));
+#else
+#undef WITH_TOUCH_WAKE
 #endif // WITH_TOUCHPADS
 
 #include "DimmerBLEServer.h"
+#ifdef WITH_TOUCH_WAKE
+#include "TouchWake.h"
+#endif
 
 using namespace Lissabon;
 
@@ -89,6 +108,9 @@ public:
     dimmerUI(dimmer),
 #endif
     dimmerBLEServer(dimmer)
+#ifdef WITH_USAGE_SCHEDULE
+    , usageSchedule(dimmer)
+#endif
   {
   }
   void setup();
@@ -102,6 +124,9 @@ protected:
   void dimmerOnOffChanged() override;
   void dimmerValueChanged() override;
   void dimmerAvailableChanged() override {};
+#ifdef WITH_TOUCH_WAKE
+  void sleepWakeupNotification(bool sleep) override;
+#endif
   bool getHandler(const char *path, JsonObject& reply) override;
   bool putHandler(const char *path, const JsonVariant& request, JsonObject& reply) override;
 private:
@@ -109,8 +134,14 @@ private:
   LedstripDimmer dimmer;
 #ifdef WITH_TOUCHPADS
   DimmerUI dimmerUI;
+#endif
+#ifdef WITH_TOUCH_WAKE
+  TouchWake touchWake;
 #endif
   DimmerBLEServer dimmerBLEServer;
+#ifdef WITH_USAGE_SCHEDULE
+  UsageSchedule usageSchedule;
+#endif
   void handler();
 
   uint32_t saveAtMillis = 0;
@@ -193,6 +224,16 @@ String LissabonLedstripMod::info() {
 
 bool LissabonLedstripMod::getHandler(const char *path, JsonObject& reply) {
   dimmer.getHandler(reply);
+  JsonObject bleReply = reply["ble"].to<JsonObject>();
+  dimmerBLEServer.getHandler(bleReply);
+#ifdef WITH_TOUCH_WAKE
+  JsonObject touchWakeReply = reply["touchWake"].to<JsonObject>();
+  touchWake.getHandler(touchWakeReply);
+#endif
+#ifdef WITH_USAGE_SCHEDULE
+  JsonObject scheduleReply = reply["schedule"].to<JsonObject>();
+  usageSchedule.getHandler(scheduleReply);
+#endif
   iotsaConfig.extendCurrentMode();
   return true;
 }
@@ -202,11 +243,16 @@ bool LissabonLedstripMod::putHandler(const char *path, const JsonVariant& reques
   JsonObject reqObj = request.as<JsonObject>();
   if (!reqObj) return false;
   if (dimmer.putHandler(reqObj)) anyChanged = true;
+  bool dimmerChanged = anyChanged;
+#ifdef WITH_USAGE_SCHEDULE
+  JsonVariant scheduleRequest = reqObj["schedule"];
+  if (scheduleRequest && usageSchedule.putHandler(scheduleRequest)) anyChanged = true;
+#endif
   if (anyChanged) {
     // Should do this only for configuration changes
     configSave();
   }
-  if (anyChanged) dimmer.updateDimmer(); // xxxjack or is this called already?
+  if (dimmerChanged) dimmer.updateDimmer(); // xxxjack or is this called already?
   iotsaConfig.extendCurrentMode();
   return anyChanged;
 
@@ -225,11 +271,17 @@ void LissabonLedstripMod::serverSetup() {
 void LissabonLedstripMod::configLoad() {
   IotsaConfigFileLoad cf("/config/ledstrip.cfg");
   dimmer.configLoad(cf, "ledstrip");
+#ifdef WITH_USAGE_SCHEDULE
+  usageSchedule.configLoad(cf, "schedule");
+#endif
 }
 
 void LissabonLedstripMod::configSave() {
   IotsaConfigFileSave cf("/config/ledstrip.cfg");
   dimmer.configSave(cf, "ledstrip");
+#ifdef WITH_USAGE_SCHEDULE
+  usageSchedule.configSave(cf, "schedule");
+#endif
 }
 
 void LissabonLedstripMod::setup() {
@@ -240,18 +292,37 @@ void LissabonLedstripMod::setup() {
 #endif
 #ifdef PIN_DISABLESLEEP
   batteryMod.setPinDisableSleep(PIN_DISABLESLEEP);
+#endif
+#ifdef WITH_USAGE_SCHEDULE
+  batteryMod.setSchedule(&usageSchedule);
 #endif
   configLoad();
 #ifdef WITH_TOUCHPADS
   iotsaConfig.allowRCMDescription("tap any touchpad 4 times");
   dimmerUI.setUpDownButtons(levelEncoder);
   dimmerUI.setTemperatureUpDownButtons(temperatureEncoder);
+#endif
+#ifdef WITH_TOUCH_WAKE
+  touchWake.addPad(PIN_TOUCH_UP, std::bind(&DimmerUI::tapUpDown, &dimmerUI, true));
+  touchWake.addPad(PIN_TOUCH_DOWN, std::bind(&DimmerUI::tapUpDown, &dimmerUI, false));
+  touchWake.addPad(PIN_TOUCH_UPTEMP, std::bind(&DimmerUI::tapTemperatureUpDown, &dimmerUI, true));
+  touchWake.addPad(PIN_TOUCH_DOWNTEMP, std::bind(&DimmerUI::tapTemperatureUpDown, &dimmerUI, false));
 #endif
   dimmer.setup();
   dimmerBLEServer.setup();
   dimmer.updateDimmer();
 }
 
+#ifdef WITH_TOUCH_WAKE
+void LissabonLedstripMod::sleepWakeupNotification(bool sleep) {
+  if (sleep) {
+    touchWake.sleep();
+  } else {
+    touchWake.wakeup();
+  }
+}
+#endif
+
 void LissabonLedstripMod::dimmerValueChanged() {
   iotsaConfig.postponeSleep(2000);
   saveAtMillis = millis() + 1000;
@@ -264,7 +335,11 @@ void LissabonLedstripMod::loop() {
     IFDEBUG IotsaSerial.println("save ledstrip config");
     configSave();
   }
+  dimmerBLEServer.loop();
   dimmer.loop();
+#ifdef WITH_USAGE_SCHEDULE
+  usageSchedule.loop();
+#endif
 }
 
 // Instantiate the Led module, and install it in the framework
@@ -16,6 +16,10 @@
 
 #define WITH_OTA    // Enable Over The Air updates from ArduinoIDE. Needs at least 1MB flash.
 #define LED_PIN 22  // Define to turn on the LED when powered and not sleeping.
+#define WITH_TOUCH_WAKE // Touch sensor wakes us from sleep, so a long sleepDuration doesn't lose taps
+#if defined(REMOTE_WITH_DEEP_SLEEP) && !defined(WITH_TOUCH_WAKE)
+#define WITH_TOUCH_WAKE // Deep sleep wakeups use the same pad thresholds
+#endif
 
 //
 // Device can be rebooted or configuration mode can be requested by quickly tapping any button.
@@ -39,12 +43,16 @@ IotsaOtaMod otaMod(application);
 IotsaBatteryMod batteryMod(application);
 
 #include "iotsaInput.h"
-Touchpad touch1down(32, true, true, true);
-Touchpad touch1up(13, true, true, true);
+#define PIN_TOUCH1DOWN 32
+#define PIN_TOUCH1UP 13
+#define PIN_TOUCH2DOWN 14
+#define PIN_TOUCH2UP 15
+Touchpad touch1down(PIN_TOUCH1DOWN, true, true, true);
+Touchpad touch1up(PIN_TOUCH1UP, true, true, true);
 UpDownButtons encoder1(touch1down, touch1up, true);
 #ifdef WITH_SECOND_DIMMER
-Touchpad touch2down(14, true, true, true);
-Touchpad touch2up(15, true, true, true);
+Touchpad touch2down(PIN_TOUCH2DOWN, true, true, true);
+Touchpad touch2up(PIN_TOUCH2UP, true, true, true);
 UpDownButtons encoder2(touch2down, touch2up, true);
 #endif // WITH_SECOND_DIMMER
 
@@ -62,6 +70,12 @@ IotsaInputMod touchMod(application, inputs, sizeof(inputs)/sizeof(inputs[0]));
 #include "DimmerCollection.h"
 #include "BLEDimmer.h"
 #include "DimmerUI.h"
+#ifdef REMOTE_WITH_DEEP_SLEEP
+#include "DeepSleepRemote.h"
+#endif
+#ifdef WITH_TOUCH_WAKE
+#include "TouchWake.h"
+#endif
 
 using namespace Lissabon;
 
@@ -78,6 +92,15 @@ public:
     dimmer->followDimmerChanges(true);
     dimmers.push_back(dimmer);
   #endif
+  #ifdef WITH_TOUCH_WAKE
+    // The UIs don't exist yet, but they do by the time a tap is handed to us.
+    touchWake.addPad(PIN_TOUCH1DOWN, [this]() { dimmerUIs[0]->tapUpDown(false); });
+    touchWake.addPad(PIN_TOUCH1UP, [this]() { dimmerUIs[0]->tapUpDown(true); });
+  #ifdef WITH_SECOND_DIMMER
+    touchWake.addPad(PIN_TOUCH2DOWN, [this]() { dimmerUIs[1]->tapUpDown(false); });
+    touchWake.addPad(PIN_TOUCH2UP, [this]() { dimmerUIs[1]->tapUpDown(true); });
+  #endif
+  #endif
   }
   void setup() override;
   void serverSetup() override;
@@ -85,6 +108,13 @@ public:
   void configLoad() override;
   void configSave() override;
   void loop() override;
+  void sleepWakeupNotification(bool sleep) override;
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Woken by a touchpad: send its command without booting. Returns false if that didn't work.
+  static bool deepSleepCommand();
+  // Back to deep sleep after deepSleepCommand(). Doesn't return.
+  void deepSleep();
+#endif
 
 protected:
   bool getHandler(const char *path, JsonObject& reply) override;
@@ -97,8 +127,16 @@ private:
   void handler();
   void ledOn();
   void ledOff();
+  // Start connecting to a dimmer as soon as one of its pads is touched (or
+  // woke us up), so the link is ready by the time the command comes.
+  void preconnectOnTouch();
+  void preconnectOnWakeup();
+  bool padsTouched[2] = {false, false};
   DimmerCollection dimmers;
   std::vector<DimmerUI*> dimmerUIs;
+#ifdef WITH_TOUCH_WAKE
+  TouchWake touchWake;
+#endif
   uint32_t saveAtMillis = 0;
   uint32_t ledOffUntilMillis = 0;
   uint32_t lastButtonChangeMillis = 0;
@@ -118,6 +156,73 @@ void LissabonRemoteMod::ledOff() {
   
 }
 
+void LissabonRemoteMod::preconnectOnTouch() {
+  bool touched = touch1down.pressed || touch1up.pressed;
+  if (touched && !padsTouched[0]) dimmers.at(0)->preconnect();
+  padsTouched[0] = touched;
+#ifdef WITH_SECOND_DIMMER
+  touched = touch2down.pressed || touch2up.pressed;
+  if (touched && !padsTouched[1]) dimmers.at(1)->preconnect();
+  padsTouched[1] = touched;
+#endif
+}
+
+void LissabonRemoteMod::preconnectOnWakeup() {
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TOUCHPAD) return;
+  int pad = esp_sleep_get_touchpad_wakeup_status();
+  IFDEBUG IotsaSerial.printf("woken by touchpad %d\n", pad);
+  if (pad == digitalPinToTouchChannel(PIN_TOUCH1DOWN) || pad == digitalPinToTouchChannel(PIN_TOUCH1UP)) {
+    dimmers.at(0)->preconnect();
+  }
+#ifdef WITH_SECOND_DIMMER
+  if (pad == digitalPinToTouchChannel(PIN_TOUCH2DOWN) || pad == digitalPinToTouchChannel(PIN_TOUCH2UP)) {
+    dimmers.at(1)->preconnect();
+  }
+#endif
+}
+
+void LissabonRemoteMod::sleepWakeupNotification(bool sleep) {
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  if (sleep) {
+    // In case this is a deep sleep: what the next wakeup needs to skip booting.
+    DeepSleepRemote::save(0, *static_cast<BLEDimmer *>(dimmers.at(0)));
+#ifdef WITH_SECOND_DIMMER
+    DeepSleepRemote::save(1, *static_cast<BLEDimmer *>(dimmers.at(1)));
+#endif
+  }
+#endif
+#ifdef WITH_TOUCH_WAKE
+  if (sleep) {
+    touchWake.sleep();
+  } else {
+    touchWake.wakeup();
+  }
+#endif
+  if (!sleep) preconnectOnWakeup();
+}
+
+#ifdef REMOTE_WITH_DEEP_SLEEP
+bool LissabonRemoteMod::deepSleepCommand() {
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TOUCHPAD) return false;
+  int pad = esp_sleep_get_touchpad_wakeup_status();
+  if (pad == digitalPinToTouchChannel(PIN_TOUCH1UP)) return DeepSleepRemote::sendCommand(0, DeepSleepRemote::command_up);
+  if (pad == digitalPinToTouchChannel(PIN_TOUCH1DOWN)) return DeepSleepRemote::sendCommand(0, DeepSleepRemote::command_down);
+#ifdef WITH_SECOND_DIMMER
+  if (pad == digitalPinToTouchChannel(PIN_TOUCH2UP)) return DeepSleepRemote::sendCommand(1, DeepSleepRemote::command_up);
+  if (pad == digitalPinToTouchChannel(PIN_TOUCH2DOWN)) return DeepSleepRemote::sendCommand(1, DeepSleepRemote::command_down);
+#endif
+  return false;
+}
+
+void LissabonRemoteMod::deepSleep() {
+  // Same thresholds as for light sleep. Calibrated after the release, so
+  // the finger that woke us doesn't end up in them.
+  touchWake.waitForRelease(5000);
+  touchWake.sleep();
+  DeepSleepRemote::sleep();
+}
+#endif
+
 void LissabonRemoteMod::dimmerOnOffChanged() {
   // Called whenever any button changed state.
   // Used to give visual feedback (led turning off) on presses and releases,
@@ -184,6 +289,14 @@ bool LissabonRemoteMod::getHandler(const char *path, JsonObject& reply) {
   // xxxjack need to distinguish between config and operational parameters
   IotsaBLEClientMod::getHandler(path, reply);
   dimmers.getHandler(reply);
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  JsonObject deepSleepReply = reply["deepSleep"].to<JsonObject>();
+  DeepSleepRemote::getHandler(deepSleepReply);
+#endif
+#ifdef WITH_TOUCH_WAKE
+  JsonObject touchWakeReply = reply["touchWake"].to<JsonObject>();
+  touchWake.getHandler(touchWakeReply);
+#endif
   return true;
 }
 
@@ -229,6 +342,13 @@ void LissabonRemoteMod::setup() {
   // Load configuration
   //
   configLoad();
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Pick up what the fast path did while we were asleep, until the dimmers tell us.
+  DeepSleepRemote::restore(0, *static_cast<BLEDimmer *>(dimmers.at(0)));
+#ifdef WITH_SECOND_DIMMER
+  DeepSleepRemote::restore(1, *static_cast<BLEDimmer *>(dimmers.at(1)));
+#endif
+#endif
   //
   // Setup LED (fur user feedback) and pin for disabling sleep
   //
@@ -262,6 +382,11 @@ void LissabonRemoteMod::setup() {
   // Setup dimmers by getting current settings from BLE devices
   //
   dimmers.setup();
+  // After a deep sleep we come through here in stead of sleepWakeupNotification().
+#ifdef WITH_TOUCH_WAKE
+  touchWake.wakeup();
+#endif
+  preconnectOnWakeup();
   ledOff();
 }
 
@@ -284,6 +409,7 @@ void LissabonRemoteMod::loop() {
   // Let our baseclass do its loop-y things
   //
   IotsaBLEClientMod::loop();
+  preconnectOnTouch();
   
   //
   // See whether we have a value to save (because the user has been turning the dimmer)
@@ -301,6 +427,12 @@ LissabonRemoteMod remoteMod(application);
 
 // Standard setup() method, hands off most work to the application framework
 void setup(void){
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Woken from deep sleep by a touchpad: do its command without booting, if we can.
+  if (LissabonRemoteMod::deepSleepCommand()) {
+    remoteMod.deepSleep();
+  }
+#endif
   application.setup();
   application.serverSetup();
 }
@@ -98,6 +98,8 @@ String LissabonSimpleLightMod::info() {
 
 bool LissabonSimpleLightMod::getHandler(const char *path, JsonObject& reply) {
   dimmer.getHandler(reply);
+  JsonObject bleReply = reply["ble"].to<JsonObject>();
+  dimmerBLEServer.getHandler(bleReply);
   return true;
 }
 
@@ -116,6 +118,7 @@ void LissabonSimpleLightMod::configSave() {
 }
 
 void LissabonSimpleLightMod::loop() {
+  dimmerBLEServer.loop();
   dimmer.loop();
   if (dimmer.isOn != lastSavedIsOn) {
     lastSavedIsOn = dimmer.isOn;
@@ -23,6 +23,9 @@ IotsaBLEClientMod bleClientMod(application);
 
 #include "BLEDimmer.h"
 #include "DimmerUI.h"
+#ifdef REMOTE_WITH_DEEP_SLEEP
+#include "DeepSleepRemote.h"
+#endif
 
 using namespace Lissabon;
 
@@ -40,26 +43,55 @@ public:
   void configLoad();
   void configSave();
   void loop();
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Deep sleep until the button is pressed. Doesn't return.
+  static void deepSleep();
+#endif
 protected:
   bool getHandler(const char *path, JsonObject& reply) override;
   bool putHandler(const char *path, const JsonVariant& request, JsonObject& reply) override;
 private:
   // Fires on the optimistic local button press, before the remote has
   // confirmed anything -- deliberately not used to drive the LED.
-  void dimmerOnOffChanged() override {}
+  void dimmerOnOffChanged() override;
   // Fires once a value has actually been confirmed from the remote device
   // over BLE -- this is what drives the LED.
   void dimmerValueChanged() override;
   void dimmerAvailableChanged() override {}
   BLEDimmer dimmer;
   DimmerUI dimmerUI;
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Go to deep sleep when nothing has happened for this long.
+  uint32_t lastActivityMillis = 0;
+  const uint32_t deepSleepIdleMillis = 30000;
+#endif
 };
 
 Button button(BUTTON_PIN, true, true, true);
 
+void LissabonSimpleRemoteMod::dimmerOnOffChanged() {
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  lastActivityMillis = millis();
+#endif
+}
+
 void LissabonSimpleRemoteMod::dimmerValueChanged() {
   digitalWrite(LED_PIN, dimmer.isOn ? HIGH : LOW);
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  lastActivityMillis = millis();
+#endif
+}
+
+#ifdef REMOTE_WITH_DEEP_SLEEP
+void LissabonSimpleRemoteMod::deepSleep() {
+  // Otherwise the press that woke us wakes us again straight away.
+  pinMode(BUTTON_PIN, INPUT_PULLUP);
+  uint32_t giveUpMillis = millis() + 5000;
+  while (digitalRead(BUTTON_PIN) == LOW && millis() < giveUpMillis) delay(10);
+  esp_sleep_enable_ext0_wakeup((gpio_num_t)BUTTON_PIN, 0);
+  DeepSleepRemote::sleep();
 }
+#endif
 
 void LissabonSimpleRemoteMod::setup() {
   pinMode(LED_PIN, OUTPUT);
@@ -68,6 +100,12 @@ void LissabonSimpleRemoteMod::setup() {
   dimmerUI.setOnOffButton(button);
   bleClientMod.setServiceFilter(Lissabon::Dimmer::serviceUUID);
   dimmer.followDimmerChanges(true);
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Show what the fast path did while we were asleep, until the dimmer tells us.
+  DeepSleepRemote::restore(0, dimmer);
+  digitalWrite(LED_PIN, dimmer.isOn ? HIGH : LOW);
+  lastActivityMillis = millis();
+#endif
   dimmer.setup();
 }
 
@@ -82,6 +120,10 @@ String LissabonSimpleRemoteMod::info() {
 
 bool LissabonSimpleRemoteMod::getHandler(const char *path, JsonObject& reply) {
   dimmer.getHandler(reply);
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  JsonObject deepSleepReply = reply["deepSleep"].to<JsonObject>();
+  DeepSleepRemote::getHandler(deepSleepReply);
+#endif
   return true;
 }
 
@@ -106,6 +148,15 @@ void LissabonSimpleRemoteMod::configSave() {
 
 void LissabonSimpleRemoteMod::loop() {
   dimmer.loop();
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  BLEDimmer::Status status = dimmer.status();
+  if (status.connecting || status.connected || status.pending) lastActivityMillis = millis();
+  if (millis() - lastActivityMillis > deepSleepIdleMillis) {
+    IFDEBUG IotsaSerial.println("remote: idle, deep sleep");
+    DeepSleepRemote::save(0, dimmer);
+    deepSleep();
+  }
+#endif
 }
 
 // Instantiate the remote module, and install it in the framework
@@ -113,6 +164,12 @@ LissabonSimpleRemoteMod remoteMod(application);
 
 // Standard setup() method, hands off most work to the application framework
 void setup(void){
+#ifdef REMOTE_WITH_DEEP_SLEEP
+  // Woken by the button: toggle the dimmer without booting, if we can.
+  if (DeepSleepRemote::wokeByUser() && DeepSleepRemote::sendCommand(0, DeepSleepRemote::command_toggle)) {
+    LissabonSimpleRemoteMod::deepSleep();
+  }
+#endif
   application.setup();
   application.serverSetup();
 }